@@ -0,0 +1,109 @@
+#pragma once
+
+#include <array>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "modeldata.hpp"
+#include "utils/fileprovider.hpp"
+
+struct CachedTexture
+{
+    std::uint64_t hash = 0; // hash of the texture file and quantizer options
+    int width;
+    int height;
+    std::vector<std::uint8_t> pixels; // rows as stored in the BMP, bottom row first
+    std::vector<std::uint8_t> palette;
+};
+
+// An animation SMD parsed with one set of QC options, sequences crop their frame range out of it
+struct CachedAnimation
+{
+    std::uint64_t hash = 0; // hash of the SMD file
+    std::vector<Node> nodes;
+    std::bitset<MAXSTUDIOANIMATIONS> parsedframes; // times whose blocks were parsed, the others were skipped
+    int firstframe = 0;                    // time of frame 0
+    std::vector<std::uint8_t> framemask;   // [frame], 1 if the SMD has a time block for the frame
+    std::vector<std::vector<Vector3>> pos; // [node][frame]
+    std::vector<std::vector<Vector3>> rot; // [node][frame]
+};
+
+// Bounding box and compressed animations of a sequence
+struct CachedSequence
+{
+    std::uint64_t hash = 0; // hash of the relinked frames, the bone table and the reference vertices
+    Vector3 bmin;
+    Vector3 bmax;
+    std::vector<std::vector<StudioAnimationValue>> anims; // [blend][bone][DOF] flattened, empty if numanim is 0
+};
+
+// The last model compiled, rebuilt from its texture section alone when only textures changed
+struct CachedModel
+{
+    std::uint64_t hash = 0; // hash of the QC path, the compile options and every input besides the textures
+    std::vector<std::filesystem::path> dependencies; // every file read, textures included
+    std::filesystem::path cdtexture;
+    float gamma = 1.8f;
+    std::vector<Texture> textures; // after set_skin_values, before duplicates are merged, without pixel data
+    std::vector<int> duplicates;   // find_duplicate_textures
+    std::array<std::array<int, MAXSTUDIOSKINS>, 256> skinref;
+    int skinrefcount = 0;
+    int skinfamiliescount = 0;
+    std::vector<std::byte> mdl;
+    std::vector<std::byte> texture_model;
+    std::vector<std::vector<std::byte>> sequence_groups;
+};
+
+// Decoded textures, parsed animations and compressed sequences kept between compiles.
+// Entries are checked against the hash of their inputs, so edited files are always reloaded.
+struct CompileCache
+{
+    std::unordered_map<std::string, CachedTexture> textures;     // by texture path
+    std::unordered_map<std::string, CachedAnimation> animations; // by SMD path and parse options
+    std::unordered_map<std::string, CachedSequence> sequences;   // by QC path and sequence name
+    std::unordered_map<std::string, CachedModel> models;          // by QC path
+
+    int texture_hits = 0;
+    int texture_misses = 0;
+    int animation_hits = 0;
+    int animation_misses = 0;
+    int sequence_hits = 0;
+    int sequence_misses = 0;
+};
+
+// Drops the entries whose texture, SMD or QC file no longer exists, so a long-lived cache doesn't keep deleted inputs
+void prune_compile_cache(CompileCache &cache);
+
+struct CompileInput
+{
+    std::filesystem::path qc_path;
+    FileProvider *files = nullptr;   // where the QC, SMD and BMP files are read from, nullptr reads from disk
+    CompileCache *cache = nullptr;   // optional, reuses decoded inputs of previous compiles
+    std::vector<std::filesystem::path> *dependencies = nullptr; // optional, receives every file read
+    std::vector<std::filesystem::path> *missing = nullptr; // optional, receives every file looked up but not found
+    std::vector<std::vector<std::byte>> *sequence_groups = nullptr; // receives <model>01.mdl, <model>02.mdl, ... if the model has sequence groups
+    std::vector<std::byte> *texture_model = nullptr; // receives <model>T.mdl if the textures are external, empty otherwise
+    std::filesystem::path smd_cache_dir; // optional, binary cache of parsed SMD files shared between compiles
+    std::filesystem::path texture_cache_dir; // optional, true-color textures quantized by previous compiles
+    std::uintmax_t *cache_bytes_written = nullptr; // optional, receives the bytes written to the two directories above
+    bool invert_normals = false;     // -f
+    float normal_blend_angle = 2.0f; // -a, in degrees
+    bool keep_all_bones = false;     // -b
+    float anim_tolerance_pos = 0.0f; // --anim-tolerance pos=, in units, 0 keeps animations lossless
+    float anim_tolerance_rot = 0.0f; // --anim-tolerance rot=, in degrees
+    int sequence_group_size = 0;     // --sequence-group-size, in KB, 0 uses $sequencegroupsize
+    bool external_textures = false;  // --external-textures, same as $externaltextures
+    bool dither_textures = false;    // --dither, when quantizing true-color textures
+    int max_texture_dim = 0;         // --max-texture-dim, larger textures are downscaled, 0 keeps the source size
+    int texture_budget = 0;          // --texture-budget, in KB of texels for the whole model, 0 for no limit
+    int section_align = 4;           // --align, in bytes, for the bone, animation, vertex and normal sections
+};
+
+// Compiles a QC script and returns the .mdl file contents, calls error() on failure.
+// Sequence group files and the texture model are returned through input.sequence_groups and input.texture_model
+std::vector<std::byte> compile(const CompileInput &input);
@@ -0,0 +1,447 @@
+// driver.cpp: command line handling shared by the CLI and the compile server
+
+#include "driver.hpp"
+
+#include <cstdlib>
+#include <iostream>
+
+#include "format/mdl.hpp"
+#include "outputcache.hpp"
+#include "utils/cmdlib.hpp"
+#include "utils/mappedfile.hpp"
+
+void usage(const char *program_name)
+{
+	std::cerr
+		<< "Usage: " << program_name << " <inputfile.qc> <flags>\n"
+		<< "       " << program_name << " --serve [--socket <path>]\n"
+		<< "  Flags:\n"
+		<< "    [-f]                Invert normals\n"
+		<< "    [-a <angle>]        Set vertex normal blend angle override\n"
+		<< "    [-b]                Keep all unused bones\n"
+		<< "    [--anim-tolerance pos=<units>,rot=<degrees>]\n"
+		<< "                        Merge animation values within the tolerance into runs (lossy)\n"
+		<< "    [--sequence-group-size <KB>]\n"
+		<< "                        Move animations past this size to <model>01.mdl, <model>02.mdl, ...\n"
+		<< "    [--external-textures]\n"
+		<< "                        Write the textures to <model>T.mdl\n"
+		<< "    [--dither]          Dither true-color textures when reducing them to 256 colors\n"
+		<< "    [--max-texture-dim <pixels>]\n"
+		<< "                        Downscale textures wider or taller than this\n"
+		<< "    [--texture-budget <KB>]\n"
+		<< "                        Downscale all textures until their pixels fit in this size\n"
+		<< "    [--align <bytes>]   Align the bone, animation, vertex and normal sections to 16 or 64 bytes\n"
+		<< "    [-MD]               Write a Make/Ninja depfile next to the model (<model>.mdl.d)\n"
+		<< "    [--depfile <path>]  Write a Make/Ninja depfile listing every file read\n"
+		<< "    [--cache-dir <dir>] Reuse models compiled from identical inputs (default $STUDIOMDL_CACHE_DIR)\n"
+		<< "    [--cache-size <MB>] Cache size limit, least recently used models are evicted (default 1024)\n"
+		<< "    [--cache-stats]     Print cache hit/miss statistics\n"
+		<< "    [--watch]           Recompile whenever the QC or one of its inputs changes\n"
+		<< "    [--serve]           Run a compile server that keeps inputs in memory between compiles\n"
+		<< "    [--socket <path>]   Compile server socket path\n"
+		<< "    [--no-server]       Compile in this process even if a compile server is running\n";
+	std::exit(EXIT_FAILURE);
+}
+
+// Parses "pos=<units>,rot=<degrees>", either part may be left out
+static void parse_anim_tolerance(const std::string &value, CompileInput &input)
+{
+	std::size_t start = 0;
+	while (start <= value.size())
+	{
+		std::size_t end = value.find(',', start);
+		if (end == std::string::npos)
+			end = value.size();
+		const std::string part = value.substr(start, end - start);
+		const std::size_t equals = part.find('=');
+		const std::string name = part.substr(0, equals);
+		float tolerance = -1.0f;
+		try
+		{
+			std::size_t used = 0;
+			if (equals != std::string::npos)
+				tolerance = std::stof(part.substr(equals + 1), &used);
+			if (used != part.size() - equals - 1)
+				tolerance = -1.0f;
+		}
+		catch (const std::exception &)
+		{
+		}
+		if (!(tolerance >= 0.0f) || (name != "pos" && name != "rot"))
+		{
+			error("Invalid value for --anim-tolerance flag. Expected pos=<units>,rot=<degrees>.");
+		}
+		(name == "pos" ? input.anim_tolerance_pos : input.anim_tolerance_rot) = tolerance;
+		start = end + 1;
+	}
+}
+
+// The whole value must be a number greater than zero
+static int parse_positive_int(const std::string &value, const std::string &name, const std::string &unit)
+{
+	int result = 0;
+	try
+	{
+		std::size_t used = 0;
+		result = std::stoi(value, &used);
+		if (used != value.size())
+			result = 0;
+	}
+	catch (const std::exception &)
+	{
+	}
+	if (result <= 0)
+	{
+		error("Invalid value for " + name + " flag. Expected a size in " + unit + ".");
+	}
+	return result;
+}
+
+Options parse_options(const std::vector<std::string> &args)
+{
+	Options options{};
+	std::size_t i = 0;
+
+	if (!args.empty() && !args[0].empty() && args[0][0] != '-')
+	{
+		options.input.qc_path = args[0];
+		if (options.input.qc_path.extension() != ".qc")
+		{
+			error("The first argument must be a .qc file");
+		}
+		i = 1;
+	}
+
+	for (; i < args.size(); ++i)
+	{
+		const std::string &arg = args[i];
+		if (arg == "--serve")
+		{
+			options.serve = true;
+		}
+		else if (arg == "--watch")
+		{
+			options.watch = true;
+		}
+		else if (arg == "--no-server")
+		{
+			options.no_server = true;
+		}
+		else if (arg == "-MD")
+		{
+			options.depfile_next_to_output = true;
+		}
+		else if (arg == "--depfile")
+		{
+			if (i + 1 >= args.size())
+			{
+				error("Missing value for --depfile flag.");
+			}
+			options.depfile = args[++i];
+		}
+		else if (arg == "--cache-dir")
+		{
+			if (i + 1 >= args.size())
+			{
+				error("Missing value for --cache-dir flag.");
+			}
+			options.cache_dir = args[++i];
+		}
+		else if (arg == "--cache-size")
+		{
+			if (i + 1 >= args.size())
+			{
+				error("Missing value for --cache-size flag.");
+			}
+			options.cache_size = static_cast<std::uintmax_t>(parse_positive_int(args[++i], arg, "megabytes")) << 20;
+		}
+		else if (arg == "--cache-stats")
+		{
+			options.cache_stats = true;
+		}
+		else if (arg == "--anim-tolerance")
+		{
+			if (i + 1 >= args.size())
+			{
+				error("Missing value for --anim-tolerance flag.");
+			}
+			parse_anim_tolerance(args[++i], options.input);
+		}
+		else if (arg == "--sequence-group-size")
+		{
+			if (i + 1 >= args.size())
+			{
+				error("Missing value for --sequence-group-size flag.");
+			}
+			options.input.sequence_group_size = parse_positive_int(args[++i], arg, "kilobytes");
+		}
+		else if (arg == "--external-textures")
+		{
+			options.input.external_textures = true;
+		}
+		else if (arg == "--dither")
+		{
+			options.input.dither_textures = true;
+		}
+		else if (arg == "--max-texture-dim")
+		{
+			if (i + 1 >= args.size())
+			{
+				error("Missing value for --max-texture-dim flag.");
+			}
+			options.input.max_texture_dim = parse_positive_int(args[++i], arg, "pixels");
+		}
+		else if (arg == "--texture-budget")
+		{
+			if (i + 1 >= args.size())
+			{
+				error("Missing value for --texture-budget flag.");
+			}
+			options.input.texture_budget = parse_positive_int(args[++i], arg, "kilobytes");
+		}
+		else if (arg == "--align")
+		{
+			if (i + 1 >= args.size())
+			{
+				error("Missing value for --align flag.");
+			}
+			options.input.section_align = parse_positive_int(args[++i], arg, "bytes");
+			if (options.input.section_align != 4 && options.input.section_align != 16 && options.input.section_align != 64)
+			{
+				error("Invalid value for --align flag. Expected 4, 16 or 64.");
+			}
+		}
+		else if (arg == "--socket")
+		{
+			if (i + 1 >= args.size())
+			{
+				error("Missing value for --socket flag.");
+			}
+			options.socket_path = args[++i];
+		}
+		else if (arg.size() == 2 && arg[0] == '-')
+		{
+			switch (arg[1])
+			{
+			case 'f':
+				options.input.invert_normals = true;
+				break;
+			case 'a':
+				if (i + 1 >= args.size())
+				{
+					error("Missing value for -a flag.");
+				}
+				try
+				{
+					options.input.normal_blend_angle = std::stof(args[++i]);
+				}
+				catch (const std::invalid_argument &)
+				{
+					error("Invalid value for -a flag. Expected a numeric angle.");
+				}
+				break;
+			case 'b':
+				options.input.keep_all_bones = true;
+				break;
+			default:
+				error("Unknown flag: " + arg);
+			}
+		}
+		else if (arg[0] == '-')
+		{
+			error("Unknown flag: " + arg);
+		}
+		else
+		{
+			error("Unexpected argument: " + arg);
+		}
+	}
+
+	if (!options.serve && !options.cache_stats && options.input.qc_path.empty())
+	{
+		error("The first argument must be a .qc file");
+	}
+
+	if (options.cache_stats && options.cache_dir.empty())
+	{
+		error("--cache-stats needs --cache-dir or STUDIOMDL_CACHE_DIR");
+	}
+
+	return options;
+}
+
+// Make and Ninja both read "\ " as a space and "$$" as a dollar sign
+static std::string escape_depfile_path(const std::filesystem::path &path)
+{
+	std::string escaped;
+	for (char c : path.generic_string())
+	{
+		if (c == ' ' || c == '#' || c == '\\')
+			escaped += '\\';
+		else if (c == '$')
+			escaped += '$';
+		escaped += c;
+	}
+	return escaped;
+}
+
+// Every file the compile wrote is a target: the model, its texture model and its sequence groups
+static void write_depfile(const std::filesystem::path &depfile, const std::vector<std::filesystem::path> &targets,
+						  const std::vector<std::filesystem::path> &dependencies)
+{
+	std::string text;
+	for (const auto &target : targets)
+	{
+		text += (text.empty() ? "" : " ") + escape_depfile_path(target);
+	}
+	text += ":";
+	for (const auto &dependency : dependencies)
+	{
+		text += " \\\n  " + escape_depfile_path(dependency);
+	}
+	text += "\n";
+
+	std::unique_ptr<std::ofstream> handle = safe_open_write(depfile);
+	safe_write(*handle, text.data(), text.size());
+}
+
+// Outputs are replaced atomically, and left untouched (modification time included) when the compile produced the same
+// bytes, so tools watching them don't see a change
+static void write_output(const std::filesystem::path &path, const std::vector<std::byte> &data)
+{
+	if (!write_if_changed(path, data.data(), data.size()))
+		printf("Unchanged: %s\n", path.filename().string().c_str());
+}
+
+static void copy_output(const std::filesystem::path &cached_file, const std::filesystem::path &path)
+{
+	MappedFile cached;
+	if (cached.open(cached_file) && file_matches(path, cached.data(), cached.size()))
+	{
+		printf("Unchanged: %s\n", path.filename().string().c_str());
+		return;
+	}
+	const std::filesystem::path temp = temporary_path(path);
+	try
+	{
+		copy_or_reflink(cached_file, temp);
+		std::filesystem::rename(temp, path);
+	}
+	catch (...)
+	{
+		std::error_code ec;
+		std::filesystem::remove(temp, ec);
+		throw;
+	}
+}
+
+// Copies the outputs of a cache hit next to the QC. Returns false when another build evicted the entry after the
+// lookup, the model is compiled then
+static bool copy_cached_outputs(const std::vector<std::filesystem::path> &cached_files, bool external_textures,
+								const std::filesystem::path &output_dir, std::vector<std::filesystem::path> &outputs, std::size_t &size)
+{
+	StudioHeader header{};
+	std::ifstream cached(cached_files[0], std::ios::binary);
+	if (!cached.read(reinterpret_cast<char *>(&header), sizeof(header)))
+		return false;
+	header.name[sizeof(header.name) - 1] = '\0';
+	const std::filesystem::path mdl_file = output_dir / header.name;
+	const std::vector<std::filesystem::path> files = model_files(mdl_file, header, external_textures);
+	if (files.size() != cached_files.size())
+		return false;
+	try
+	{
+		for (std::size_t i = files.size(); i-- > 0;) // the model, first in the list, goes last
+		{
+			copy_output(cached_files[i], files[i]);
+		}
+	}
+	catch (const std::filesystem::filesystem_error &)
+	{
+		return false;
+	}
+	outputs = files;
+	size = std::filesystem::file_size(mdl_file);
+	printf("Cache hit: %s\n", cached_files[0].filename().string().c_str());
+	return true;
+}
+
+std::size_t run_compile(const Options &options)
+{
+	CompileInput input = options.input;
+	std::vector<std::filesystem::path> dependencies;
+	const bool wants_depfile = options.depfile_next_to_output || !options.depfile.empty();
+	if ((wants_depfile || !options.cache_dir.empty()) && !input.dependencies)
+	{
+		input.dependencies = &dependencies;
+	}
+
+	// the model is written next to the QC, named after $modelname
+	const std::filesystem::path output_dir = std::filesystem::absolute(options.input.qc_path).parent_path();
+	std::vector<std::filesystem::path> outputs; // every file written, the model first
+	std::size_t size;
+
+	std::unique_ptr<OutputCache> cache;
+	std::vector<std::filesystem::path> cached_files;
+	bool external_textures = false;
+	if (!options.cache_dir.empty())
+	{
+		cache = std::make_unique<OutputCache>(options.cache_dir, options.cache_size);
+		input.smd_cache_dir = std::filesystem::absolute(options.cache_dir) / "smd";
+		input.texture_cache_dir = std::filesystem::absolute(options.cache_dir) / "tex";
+	}
+
+	const bool hit = cache && cache->lookup(input, cached_files, *input.dependencies, external_textures) &&
+					 copy_cached_outputs(cached_files, external_textures, output_dir, outputs, size);
+	if (!hit)
+	{
+		if (input.dependencies)
+		{
+			input.dependencies->clear();
+		}
+		std::vector<std::vector<std::byte>> sequence_groups;
+		std::vector<std::byte> texture_model;
+		input.sequence_groups = &sequence_groups;
+		input.texture_model = &texture_model;
+		std::uintmax_t cache_bytes_written = 0;
+		input.cache_bytes_written = &cache_bytes_written;
+		std::vector<std::byte> mdl = compile(input);
+		const StudioHeader *header = reinterpret_cast<const StudioHeader *>(mdl.data());
+		const std::filesystem::path mdl_file = output_dir / header->name;
+		size = mdl.size();
+		outputs.push_back(mdl_file);
+
+		// the model goes last, a hot reload triggered by it finds its texture model and sequence groups already replaced
+		if (!texture_model.empty())
+		{
+			outputs.push_back(texture_model_path(mdl_file));
+			write_output(outputs.back(), texture_model);
+		}
+
+		// <model>01.mdl, <model>02.mdl, ... next to the model, as named in its sequence groups
+		for (std::size_t group = 1; group <= sequence_groups.size(); group++)
+		{
+			outputs.push_back(sequence_group_path(mdl_file, static_cast<int>(group)));
+			write_output(outputs.back(), sequence_groups[group - 1]);
+		}
+		write_output(mdl_file, mdl);
+
+		if (cache)
+		{
+			cache->store(input, mdl, sequence_groups, texture_model, *input.dependencies, cache_bytes_written);
+		}
+	}
+
+	if (wants_depfile)
+	{
+		std::filesystem::path depfile = options.depfile;
+		if (depfile.empty())
+		{
+			depfile = outputs[0];
+			depfile += ".d";
+		}
+		write_depfile(depfile, outputs, *input.dependencies);
+	}
+
+	return size;
+}
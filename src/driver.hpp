@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "compile.hpp"
+
+// Command line options of studiomdl++
+struct Options
+{
+    CompileInput input;
+    bool serve = false;                // --serve
+    bool watch = false;                // --watch
+    bool no_server = false;            // --no-server
+    std::filesystem::path socket_path; // --socket <path>
+    std::filesystem::path depfile;     // --depfile <path>, -MD writes <model>.mdl.d
+    bool depfile_next_to_output = false;
+    std::filesystem::path cache_dir;           // --cache-dir <dir>
+    std::uintmax_t cache_size = 1024ull << 20; // --cache-size <MB>
+    bool cache_stats = false;                  // --cache-stats
+};
+
+[[noreturn]] void usage(const char *program_name);
+
+// args excludes the program name, calls error() on invalid arguments
+Options parse_options(const std::vector<std::string> &args);
+
+// Compiles the model and writes the .mdl next to the QC, returns the file size
+std::size_t run_compile(const Options &options);
@@ -1,6 +1,10 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <vector>
+
+#include "format/image/quantize.hpp"
 
 // __attribute__((packed)) on non-Intel arch may cause some unexpected error, plz be informed.
 #pragma pack(push, 1)
@@ -51,4 +55,25 @@ struct RGBQUAD
 };
 // for biBitCount is 16/24/32, it may be useless
 
-int load_bmp(const char *szFile, uint8_t **ppbBits, uint8_t **ppbPalette, int *width, int *height);
\ No newline at end of file
+// An 8-bit BMP read in place, the pixels are not copied out of the file
+struct BmpImage
+{
+    int width;
+    int height;
+    int stride;          // bytes per row, the width rounded up to a multiple of 4
+    const uint8_t *bits; // height rows of stride bytes, bottom row first
+    uint8_t palette[768]; // RGB, unused entries are black
+};
+
+// Returns 0, or a negative error code if the file is not an uncompressed 8-bit BMP or is truncated
+int read_bmp(const std::byte *file, std::size_t size, BmpImage *image);
+
+// Bits per pixel of a BMP, 0 if the headers are truncated
+int bmp_bit_count(const std::byte *file, std::size_t size);
+
+// Reads a 24/32-bit BMP, uncompressed or with bit field masks.
+// Returns 0, or a negative error code like read_bmp
+int read_bmp_truecolor(const std::byte *file, std::size_t size, TrueColorImage *image);
+
+// An uncompressed 8-bit BMP file read_bmp reads back as the same image
+std::vector<std::byte> write_bmp(const BmpImage &image);
\ No newline at end of file
@@ -5,52 +5,48 @@
 #include <cstdlib>
 #include <cstring>
 
-int load_bmp(const char *szFile, uint8_t **ppbBits, uint8_t **ppbPalette, int *width, int *height)
+// Reads size bytes at offset from the in-memory file, false if the file is too short
+static bool read_bytes(const std::byte *file, std::size_t filesize, std::size_t &offset, void *dest, std::size_t size)
 {
-	int rc = 0;
-	FILE *pfile = nullptr;
+	if (offset + size > filesize)
+		return false;
+	std::memcpy(dest, file + offset, size);
+	offset += size;
+	return true;
+}
+
+int read_bmp(const std::byte *file, std::size_t size, BmpImage *image)
+{
+	std::size_t offset = 0;
 	BITMAPFILEHEADER bmfh;
 	BITMAPINFOHEADER bmih;
 	RGBQUAD rgrgbPalette[256];
 	uint32_t cbBmpBits;
-	uint8_t *pbBmpBits;
-	uint8_t *pb, *pbPal = nullptr;
+	uint8_t *pb;
 	uint32_t cbPalBytes;
-	uint32_t biTrueWidth;
 
 	// Bogus parameter check
-	if (!(ppbPalette != nullptr && ppbBits != nullptr))
+	if (!(image != nullptr && file != nullptr))
 	{
 		fprintf(stderr, "invalid BMP file\n");
 		return -1000;
 	}
 
-	// File exists?
-	pfile = fopen(szFile, "rb");
-	if (pfile == nullptr)
-	{
-		fprintf(stderr, "unable to open BMP file\n");
-		return -1;
-	}
-
 	// Read file header
-	if (fread(&bmfh, sizeof bmfh, 1, pfile) != 1)
+	if (!read_bytes(file, size, offset, &bmfh, sizeof bmfh))
 	{
-		fclose(pfile);
 		return -2;
 	}
 
 	// Bogus file header check
 	if (!(bmfh.bfReserved1 == 0 && bmfh.bfReserved2 == 0))
 	{
-		fclose(pfile);
 		return -2000;
 	}
 
 	// Read info header
-	if (fread(&bmih, sizeof bmih, 1, pfile) != 1)
+	if (!read_bytes(file, size, offset, &bmih, sizeof bmih))
 	{
-		fclose(pfile);
 		return -3;
 	}
 
@@ -58,7 +54,6 @@ int load_bmp(const char *szFile, uint8_t **ppbBits, uint8_t **ppbPalette, int *w
 	if (!(bmih.biSize == sizeof bmih && bmih.biPlanes == 1))
 	{
 		fprintf(stderr, "invalid BMP file header\n");
-		fclose(pfile);
 		return -3000;
 	}
 
@@ -66,7 +61,6 @@ int load_bmp(const char *szFile, uint8_t **ppbBits, uint8_t **ppbPalette, int *w
 	if (bmih.biBitCount != 8)
 	{
 		fprintf(stderr, "BMP file not 8 bit\n");
-		fclose(pfile);
 		return -4;
 	}
 
@@ -74,7 +68,6 @@ int load_bmp(const char *szFile, uint8_t **ppbBits, uint8_t **ppbPalette, int *w
 	if (bmih.biCompression != BI_RGB)
 	{
 		fprintf(stderr, "invalid BMP compression type\n");
-		fclose(pfile);
 		return -5;
 	}
 
@@ -90,21 +83,13 @@ int load_bmp(const char *szFile, uint8_t **ppbBits, uint8_t **ppbPalette, int *w
 	}
 
 	// Read palette (bmih.biClrUsed entries)
-	if (fread(rgrgbPalette, cbPalBytes, 1, pfile) != 1)
+	if (cbPalBytes > sizeof rgrgbPalette || !read_bytes(file, size, offset, rgrgbPalette, cbPalBytes))
 	{
-		fclose(pfile);
 		return -6;
 	}
 
 	// Convert to a packed 768-byte palette
-	pbPal = (uint8_t *)malloc(768);
-	if (pbPal == nullptr)
-	{
-		fclose(pfile);
-		return -7;
-	}
-
-	pb = pbPal;
+	pb = image->palette;
 
 	// Copy over used entries
 	for (int i = 0; i < static_cast<int>(bmih.biClrUsed); i++)
@@ -122,39 +107,205 @@ int load_bmp(const char *szFile, uint8_t **ppbBits, uint8_t **ppbPalette, int *w
 		*pb++ = 0;
 	}
 
-	// Read bitmap bits (remainder of file)
-	cbBmpBits = bmfh.bfSize - ftell(pfile);
-	pb = (uint8_t *)malloc(cbBmpBits);
-	if (fread(pb, cbBmpBits, 1, pfile) != 1)
+	// Bitmap bits (remainder of file), stored with the width being rounded up to a multiple of 4
+	cbBmpBits = bmfh.bfSize - static_cast<uint32_t>(offset);
+	if (bmfh.bfSize < offset || offset + cbBmpBits > size || bmih.biWidth <= 0 || bmih.biHeight <= 0 ||
+		((static_cast<uint64_t>(bmih.biWidth) + 3) & ~uint64_t{3}) * static_cast<uint64_t>(bmih.biHeight) > cbBmpBits)
 	{
-		free(pb);
-		fclose(pfile);
 		return -7;
 	}
 
-	pbBmpBits = (uint8_t *)malloc(cbBmpBits);
+	image->width = (uint16_t)bmih.biWidth;
+	image->height = (uint16_t)bmih.biHeight;
+	image->stride = (image->width + 3) & ~3;
+	image->bits = reinterpret_cast<const uint8_t *>(file + offset);
 
-	// Data is actually stored with the width being rounded up to a multiple of 4
-	biTrueWidth = (bmih.biWidth + 3) & ~3;
+	return 0;
+}
 
-	// Reverse the order of the data
-	pb += (bmih.biHeight - 1) * biTrueWidth;
-	for (int i = 0; i < bmih.biHeight; i++)
+int bmp_bit_count(const std::byte *file, std::size_t size)
+{
+	BITMAPINFOHEADER bmih;
+	std::size_t offset = sizeof(BITMAPFILEHEADER);
+	if (!read_bytes(file, size, offset, &bmih, sizeof bmih))
 	{
-		std::memcpy(&pbBmpBits[biTrueWidth * i], pb, biTrueWidth);
-		pb -= biTrueWidth;
+		return 0;
 	}
+	return bmih.biBitCount;
+}
 
-	pb += biTrueWidth;
-	free(pb);
+// Position and width of a bit field mask
+static void mask_bits(uint32_t mask, int *shift, int *bits)
+{
+	*shift = 0;
+	*bits = 0;
+	for (; mask && !(mask & 1); mask >>= 1)
+	{
+		(*shift)++;
+	}
+	for (; mask & 1; mask >>= 1)
+	{
+		(*bits)++;
+	}
+}
 
-	*width = (uint16_t)bmih.biWidth;
-	*height = (uint16_t)bmih.biHeight;
+int read_bmp_truecolor(const std::byte *file, std::size_t size, TrueColorImage *image)
+{
+	std::size_t offset = 0;
+	BITMAPFILEHEADER bmfh;
+	BITMAPINFOHEADER bmih;
+	// red, green, blue and alpha masks of the little-endian pixel value
+	uint32_t masks[4] = {0x00FF0000, 0x0000FF00, 0x000000FF, 0};
 
-	// Set output parameters
-	*ppbPalette = pbPal;
-	*ppbBits = pbBmpBits;
+	// Bogus parameter check
+	if (!(image != nullptr && file != nullptr))
+	{
+		fprintf(stderr, "invalid BMP file\n");
+		return -1000;
+	}
+
+	// Read file header
+	if (!read_bytes(file, size, offset, &bmfh, sizeof bmfh))
+	{
+		return -2;
+	}
+
+	// Bogus file header check
+	if (!(bmfh.bfReserved1 == 0 && bmfh.bfReserved2 == 0))
+	{
+		return -2000;
+	}
+
+	// Read info header
+	if (!read_bytes(file, size, offset, &bmih, sizeof bmih))
+	{
+		return -3;
+	}
+
+	// Bogus info header check, later header versions extend the info header
+	if (!(bmih.biSize >= sizeof bmih && bmih.biPlanes == 1))
+	{
+		fprintf(stderr, "invalid BMP file header\n");
+		return -3000;
+	}
+
+	if (bmih.biBitCount != 24 && bmih.biBitCount != 32)
+	{
+		fprintf(stderr, "BMP file not 24 or 32 bit\n");
+		return -4;
+	}
+
+	// Bit fields follow the info header, or are part of the V4/V5 header along with the alpha mask
+	if (bmih.biCompression == BI_BITFIELDS && bmih.biBitCount == 32)
+	{
+		if (!read_bytes(file, size, offset, masks, 3 * sizeof(uint32_t)) ||
+			(bmih.biSize >= sizeof bmih + 4 * sizeof(uint32_t) && !read_bytes(file, size, offset, &masks[3], sizeof(uint32_t))))
+		{
+			return -6;
+		}
+	}
+	else if (bmih.biCompression == BI_RGB)
+	{
+		// the fourth byte of uncompressed 32-bit pixels is alpha, unless it is zero everywhere
+		if (bmih.biBitCount == 32)
+		{
+			masks[3] = 0xFF000000;
+		}
+	}
+	else
+	{
+		fprintf(stderr, "invalid BMP compression type\n");
+		return -5;
+	}
+
+	// Rows are padded to a multiple of 4 bytes, stored bottom up unless the height is negative
+	const int64_t height = bmih.biHeight < 0 ? -static_cast<int64_t>(bmih.biHeight) : bmih.biHeight;
+	const uint64_t stride = (static_cast<uint64_t>(bmih.biWidth) * bmih.biBitCount + 31) / 32 * 4;
+	if (bmih.biWidth <= 0 || height == 0 || bmih.biWidth > 0xFFFF || height > 0xFFFF ||
+		bmfh.bfOffBits > size || stride * height > size - bmfh.bfOffBits)
+	{
+		return -7;
+	}
+
+	int shifts[4];
+	int bits[4];
+	for (int c = 0; c < 4; c++)
+	{
+		mask_bits(masks[c], &shifts[c], &bits[c]);
+	}
+
+	image->width = bmih.biWidth;
+	image->height = static_cast<int>(height);
+	image->rgba.resize(static_cast<std::size_t>(image->width) * image->height * 4);
+	const int bytes = bmih.biBitCount / 8;
+	bool noalpha = true;
+	for (int y = 0; y < image->height; y++)
+	{
+		const int row = bmih.biHeight < 0 ? image->height - 1 - y : y;
+		const std::byte *pb = file + bmfh.bfOffBits + row * stride;
+		uint8_t *dest = &image->rgba[static_cast<std::size_t>(y) * image->width * 4];
+		for (int x = 0; x < image->width; x++, pb += bytes, dest += 4)
+		{
+			uint32_t pixel = 0;
+			std::memcpy(&pixel, pb, bytes);
+			for (int c = 0; c < 4; c++)
+			{
+				if (!bits[c])
+				{
+					dest[c] = c == 3 ? 255 : 0;
+					continue;
+				}
+				const uint64_t value = (pixel & masks[c]) >> shifts[c];
+				const uint64_t max = (uint64_t{1} << bits[c]) - 1;
+				dest[c] = static_cast<uint8_t>((value * 255 + max / 2) / max);
+			}
+			noalpha = noalpha && dest[3] == 0;
+		}
+	}
+	if (noalpha && bmih.biCompression == BI_RGB)
+	{
+		for (std::size_t i = 3; i < image->rgba.size(); i += 4)
+		{
+			image->rgba[i] = 255;
+		}
+	}
+
+	return 0;
+}
+
+std::vector<std::byte> write_bmp(const BmpImage &image)
+{
+	BITMAPFILEHEADER bmfh{};
+	BITMAPINFOHEADER bmih{};
+	RGBQUAD rgrgbPalette[256];
+	const uint32_t cbBmpBits = static_cast<uint32_t>(image.stride) * image.height;
+
+	bmfh.bfType = 0x4D42; // "BM"
+	bmfh.bfOffBits = sizeof bmfh + sizeof bmih + sizeof rgrgbPalette;
+	bmfh.bfSize = bmfh.bfOffBits + cbBmpBits;
+
+	bmih.biSize = sizeof bmih;
+	bmih.biWidth = image.width;
+	bmih.biHeight = image.height;
+	bmih.biPlanes = 1;
+	bmih.biBitCount = 8;
+	bmih.biCompression = BI_RGB;
+	bmih.biSizeImage = cbBmpBits;
+	bmih.biClrUsed = 256;
+
+	for (int i = 0; i < 256; i++)
+	{
+		rgrgbPalette[i].rgbRed = image.palette[i * 3 + 0];
+		rgrgbPalette[i].rgbGreen = image.palette[i * 3 + 1];
+		rgrgbPalette[i].rgbBlue = image.palette[i * 3 + 2];
+		rgrgbPalette[i].rgbReserved = 0;
+	}
 
-	fclose(pfile);
-	return rc;
+	std::vector<std::byte> file(bmfh.bfSize);
+	std::byte *pb = file.data();
+	std::memcpy(pb, &bmfh, sizeof bmfh);
+	std::memcpy(pb += sizeof bmfh, &bmih, sizeof bmih);
+	std::memcpy(pb += sizeof bmih, rgrgbPalette, sizeof rgrgbPalette);
+	std::memcpy(pb += sizeof rgrgbPalette, image.bits, cbBmpBits);
+	return file;
 }
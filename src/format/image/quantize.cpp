@@ -0,0 +1,361 @@
+#include "format/image/quantize.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+
+namespace
+{
+
+// A distinct color of the image and the number of pixels using it
+struct Color
+{
+	uint32_t rgb; // 0xRRGGBB
+	uint32_t count;
+};
+
+int channel(uint32_t rgb, int c)
+{
+	return (rgb >> (16 - 8 * c)) & 0xFF;
+}
+
+// Range of the colors array, split along its longest channel until there are enough boxes
+struct Box
+{
+	int begin;
+	int end;
+	int extent;	 // largest channel range
+	int longest; // channel with that range
+};
+
+Box make_box(const std::vector<Color> &colors, int begin, int end)
+{
+	int lo[3] = {255, 255, 255};
+	int hi[3] = {0, 0, 0};
+	for (int i = begin; i < end; i++)
+	{
+		for (int c = 0; c < 3; c++)
+		{
+			lo[c] = std::min(lo[c], channel(colors[i].rgb, c));
+			hi[c] = std::max(hi[c], channel(colors[i].rgb, c));
+		}
+	}
+	Box box{begin, end, -1, 0};
+	for (int c = 0; c < 3; c++)
+	{
+		if (hi[c] - lo[c] > box.extent)
+		{
+			box.extent = hi[c] - lo[c];
+			box.longest = c;
+		}
+	}
+	return box;
+}
+
+// Palette kept as one array per channel, so the distance loop compiles to vector instructions
+struct Palette
+{
+	int size = 0;
+	int32_t r[256];
+	int32_t g[256];
+	int32_t b[256];
+
+	int nearest(int red, int green, int blue) const
+	{
+		int32_t distance[256];
+		for (int i = 0; i < size; i++)
+		{
+			const int32_t dr = r[i] - red;
+			const int32_t dg = g[i] - green;
+			const int32_t db = b[i] - blue;
+			distance[i] = dr * dr + dg * dg + db * db;
+		}
+		int best = 0;
+		for (int i = 1; i < size; i++)
+		{
+			if (distance[i] < distance[best])
+				best = i;
+		}
+		return best;
+	}
+};
+
+// Weighted mean of every cluster, clusters without colors keep their entry
+void update_means(const std::vector<Color> &colors, const std::vector<int> &cluster, Palette &palette)
+{
+	uint64_t sum[256][3] = {};
+	uint64_t count[256] = {};
+	for (std::size_t i = 0; i < colors.size(); i++)
+	{
+		const int k = cluster[i];
+		for (int c = 0; c < 3; c++)
+			sum[k][c] += static_cast<uint64_t>(channel(colors[i].rgb, c)) * colors[i].count;
+		count[k] += colors[i].count;
+	}
+	for (int k = 0; k < palette.size; k++)
+	{
+		if (!count[k])
+			continue;
+		palette.r[k] = static_cast<int32_t>((sum[k][0] + count[k] / 2) / count[k]);
+		palette.g[k] = static_cast<int32_t>((sum[k][1] + count[k] / 2) / count[k]);
+		palette.b[k] = static_cast<int32_t>((sum[k][2] + count[k] / 2) / count[k]);
+	}
+}
+
+Palette median_cut(std::vector<Color> &colors, int maxcolors)
+{
+	std::vector<Box> boxes;
+	if (!colors.empty())
+		boxes.push_back(make_box(colors, 0, static_cast<int>(colors.size())));
+
+	while (static_cast<int>(boxes.size()) < maxcolors)
+	{
+		// split the box with the longest side
+		int split = -1;
+		for (int i = 0; i < static_cast<int>(boxes.size()); i++)
+		{
+			if (boxes[i].extent > 0 && (split < 0 || boxes[i].extent > boxes[split].extent))
+				split = i;
+		}
+		if (split < 0)
+			break;
+
+		const Box box = boxes[split];
+		const int c = box.longest;
+		std::sort(colors.begin() + box.begin, colors.begin() + box.end, [c](const Color &a, const Color &b)
+				  { return channel(a.rgb, c) != channel(b.rgb, c) ? channel(a.rgb, c) < channel(b.rgb, c) : a.rgb < b.rgb; });
+
+		// at the weighted median, keeping at least one color on each side
+		uint64_t total = 0;
+		for (int i = box.begin; i < box.end; i++)
+			total += colors[i].count;
+		uint64_t below = 0;
+		int middle = box.begin + 1;
+		for (int i = box.begin; i < box.end - 1; i++)
+		{
+			below += colors[i].count;
+			middle = i + 1;
+			if (below * 2 >= total)
+				break;
+		}
+		boxes[split] = make_box(colors, box.begin, middle);
+		boxes.push_back(make_box(colors, middle, box.end));
+	}
+
+	Palette palette;
+	palette.size = static_cast<int>(boxes.size());
+	std::vector<int> cluster(colors.size());
+	for (int k = 0; k < palette.size; k++)
+	{
+		for (int i = boxes[k].begin; i < boxes[k].end; i++)
+			cluster[i] = k;
+	}
+	update_means(colors, cluster, palette);
+	return palette;
+}
+
+// Masked textures are transparent where the source has low alpha or the blue key color
+bool is_transparent(const uint8_t *p, bool masked)
+{
+	return p[3] < 128 || (masked && p[0] == 0 && p[1] == 0 && p[2] == 255);
+}
+
+} // namespace
+
+void quantize_image(const TrueColorImage &image, bool dither, bool masked, std::vector<uint8_t> &bits, uint8_t palette[768])
+{
+	const int width = image.width;
+	const int height = image.height;
+	const int stride = (width + 3) & ~3;
+	const uint8_t *pixels = image.rgba.data();
+
+	// distinct opaque colors with their pixel counts
+	bool transparent = masked;
+	std::vector<Color> colors;
+	colors.reserve(static_cast<std::size_t>(width) * height);
+	for (int i = 0; i < width * height; i++)
+	{
+		const uint8_t *p = pixels + i * 4;
+		if (is_transparent(p, masked))
+			transparent = true;
+		else
+			colors.push_back({static_cast<uint32_t>(p[0] << 16 | p[1] << 8 | p[2]), 1});
+	}
+	std::sort(colors.begin(), colors.end(), [](const Color &a, const Color &b)
+			  { return a.rgb < b.rgb; });
+	std::size_t unique = 0;
+	for (std::size_t i = 0; i < colors.size(); i++)
+	{
+		if (unique && colors[unique - 1].rgb == colors[i].rgb)
+			colors[unique - 1].count++;
+		else
+			colors[unique++] = colors[i];
+	}
+	colors.resize(unique);
+
+	// index 255 is the transparent color of masked textures
+	std::vector<Color> sorted = colors;
+	Palette quantized = median_cut(sorted, transparent ? 255 : 256);
+
+	// k-means refinement
+	std::vector<int> cluster(colors.size());
+	for (int pass = 0; pass < 4 && static_cast<int>(colors.size()) > quantized.size; pass++)
+	{
+		for (std::size_t i = 0; i < colors.size(); i++)
+		{
+			const uint32_t rgb = colors[i].rgb;
+			cluster[i] = quantized.nearest(channel(rgb, 0), channel(rgb, 1), channel(rgb, 2));
+		}
+		update_means(colors, cluster, quantized);
+	}
+
+	std::memset(palette, 0, 768);
+	for (int k = 0; k < quantized.size; k++)
+	{
+		palette[k * 3 + 0] = static_cast<uint8_t>(quantized.r[k]);
+		palette[k * 3 + 1] = static_cast<uint8_t>(quantized.g[k]);
+		palette[k * 3 + 2] = static_cast<uint8_t>(quantized.b[k]);
+	}
+	if (transparent)
+	{
+		palette[255 * 3 + 2] = 255;
+	}
+
+	bits.assign(static_cast<std::size_t>(stride) * height, 0);
+	if (quantized.size == 0)
+	{
+		std::fill(bits.begin(), bits.end(), 255);
+		return;
+	}
+
+	if (!dither)
+	{
+		// every distinct color is looked up once
+		std::vector<uint8_t> index(colors.size());
+		for (std::size_t i = 0; i < colors.size(); i++)
+		{
+			const uint32_t rgb = colors[i].rgb;
+			index[i] = static_cast<uint8_t>(quantized.nearest(channel(rgb, 0), channel(rgb, 1), channel(rgb, 2)));
+		}
+		for (int y = 0; y < height; y++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				const uint8_t *p = pixels + (y * width + x) * 4;
+				if (is_transparent(p, masked))
+				{
+					bits[y * stride + x] = 255;
+					continue;
+				}
+				const uint32_t rgb = p[0] << 16 | p[1] << 8 | p[2];
+				const auto it = std::lower_bound(colors.begin(), colors.end(), rgb, [](const Color &color, uint32_t value)
+												 { return color.rgb < value; });
+				bits[y * stride + x] = index[it - colors.begin()];
+			}
+		}
+		return;
+	}
+
+	// Floyd-Steinberg, the error of each pixel is spread to the unvisited neighbors in 16ths
+	std::vector<int32_t> error(static_cast<std::size_t>(width + 2) * 3 * 2, 0);
+	int32_t *current = error.data();
+	int32_t *next = error.data() + (width + 2) * 3;
+	for (int y = 0; y < height; y++)
+	{
+		std::fill(next, next + (width + 2) * 3, 0);
+		for (int x = 0; x < width; x++)
+		{
+			const uint8_t *p = pixels + (y * width + x) * 4;
+			if (is_transparent(p, masked))
+			{
+				bits[y * stride + x] = 255;
+				continue;
+			}
+			int32_t wanted[3];
+			for (int c = 0; c < 3; c++)
+				wanted[c] = std::clamp(p[c] + current[(x + 1) * 3 + c] / 16, 0, 255);
+			const int k = quantized.nearest(wanted[0], wanted[1], wanted[2]);
+			bits[y * stride + x] = static_cast<uint8_t>(k);
+			const int32_t got[3] = {quantized.r[k], quantized.g[k], quantized.b[k]};
+			for (int c = 0; c < 3; c++)
+			{
+				const int32_t diff = wanted[c] - got[c];
+				current[(x + 2) * 3 + c] += diff * 7;
+				next[x * 3 + c] += diff * 3;
+				next[(x + 1) * 3 + c] += diff * 5;
+				next[(x + 2) * 3 + c] += diff;
+			}
+		}
+		std::swap(current, next);
+	}
+}
+
+// For every new pixel along one axis, the old pixels it covers and how much of each, in 1/size units of an old pixel
+static std::vector<std::vector<std::pair<int, int>>> coverage(int srcsize, int size)
+{
+	std::vector<std::vector<std::pair<int, int>>> spans(size);
+	for (int i = 0; i < size; i++)
+	{
+		// the new pixel spans [i * srcsize, (i + 1) * srcsize), old pixel s spans [s * size, (s + 1) * size)
+		const int begin = i * srcsize;
+		const int end = begin + srcsize;
+		for (int s = begin / size; s * size < end; s++)
+			spans[i].emplace_back(s, std::min(end, (s + 1) * size) - std::max(begin, s * size));
+	}
+	return spans;
+}
+
+void downscale_image(const uint8_t *srcbits, int srcstride, int srcwidth, int srcheight, const uint8_t palette[768],
+					 bool masked, int width, int height, std::vector<uint8_t> &bits)
+{
+	const int stride = (width + 3) & ~3;
+	bits.assign(static_cast<std::size_t>(stride) * height, 0);
+
+	Palette opaque;
+	opaque.size = masked ? 255 : 256;
+	for (int k = 0; k < opaque.size; k++)
+	{
+		opaque.r[k] = palette[k * 3 + 0];
+		opaque.g[k] = palette[k * 3 + 1];
+		opaque.b[k] = palette[k * 3 + 2];
+	}
+
+	const auto columns = coverage(srcwidth, width);
+	const auto rows = coverage(srcheight, height);
+	const uint64_t area = static_cast<uint64_t>(srcwidth) * srcheight;
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			uint64_t sum[3] = {};
+			uint64_t transparent = 0;
+			for (const auto &[sy, wy] : rows[y])
+			{
+				const uint8_t *row = srcbits + static_cast<std::size_t>(sy) * srcstride;
+				for (const auto &[sx, wx] : columns[x])
+				{
+					const int index = row[sx];
+					const uint64_t weight = static_cast<uint64_t>(wx) * wy;
+					if (masked && index == 255)
+					{
+						transparent += weight;
+						continue;
+					}
+					for (int c = 0; c < 3; c++)
+						sum[c] += palette[index * 3 + c] * weight;
+				}
+			}
+			if (transparent * 2 > area)
+			{
+				bits[y * stride + x] = 255;
+				continue;
+			}
+			const uint64_t weight = area - transparent;
+			const int red = static_cast<int>((sum[0] + weight / 2) / weight);
+			const int green = static_cast<int>((sum[1] + weight / 2) / weight);
+			const int blue = static_cast<int>((sum[2] + weight / 2) / weight);
+			bits[y * stride + x] = static_cast<uint8_t>(opaque.nearest(red, green, blue));
+		}
+	}
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// A 24/32-bit source image, before it is reduced to a palette
+struct TrueColorImage
+{
+    int width;
+    int height;
+    std::vector<uint8_t> rgba; // width * height pixels, bottom row first like an 8-bit BMP
+};
+
+// Bumped whenever quantize_image output changes, cached results are keyed by it
+constexpr int QUANTIZE_VERSION = 2;
+
+// Reduces the image to a 256 color palette: median cut over the distinct colors, refined by a few
+// k-means passes, then every pixel is mapped to its nearest palette color, with Floyd-Steinberg error
+// diffusion if dither is set. Pixels with alpha below 128 get index 255, colored blue as the engine
+// expects for masked textures. If masked, index 255 is kept for transparency even without alpha, and the
+// blue key color (0, 0, 255) of the source is transparent too.
+// bits receives height rows of (width + 3) & ~3 indices, bottom row first; palette receives 256 RGB entries
+void quantize_image(const TrueColorImage &image, bool dither, bool masked, std::vector<uint8_t> &bits, uint8_t palette[768]);
+
+// Shrinks an 8-bit image (rows of srcstride indices, bottom row first) to width x height. Every new pixel averages
+// the colors of the area it covers, then takes the nearest color of the same palette. If masked, index 255 stays
+// transparent: a new pixel is transparent when most of its area is, and is never mapped to 255 otherwise.
+// bits receives height rows of (width + 3) & ~3 indices, bottom row first
+void downscale_image(const uint8_t *srcbits, int srcstride, int srcwidth, int srcheight, const uint8_t palette[768],
+                     bool masked, int width, int height, std::vector<uint8_t> &bits);
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "format/image/quantize.hpp"
+
+#pragma pack(push, 1)
+struct TGAHEADER
+{
+    uint8_t idLength;        // 1 /* Bytes of image ID after the header */
+    uint8_t colorMapType;    // 1 /* 1 if a color map follows */
+    uint8_t imageType;       // 1 /* 2 true-color, 10 run-length encoded true-color */
+    uint16_t colorMapFirst;  // 2
+    uint16_t colorMapLength; // 2 /* Color map entries */
+    uint8_t colorMapDepth;   // 1 /* Bits per color map entry */
+    uint16_t xOrigin;        // 2
+    uint16_t yOrigin;        // 2
+    uint16_t width;          // 2
+    uint16_t height;         // 2
+    uint8_t pixelDepth;      // 1 /* Bits per pixel */
+    uint8_t descriptor;      // 1 /* Alpha bits, 0x10 right to left, 0x20 top to bottom */
+};
+#pragma pack(pop)
+
+// Reads a 24/32-bit TGA, raw or run-length encoded.
+// Returns 0, or a negative error code if the file is not a true-color TGA or is truncated
+int read_tga(const std::byte *file, std::size_t size, TrueColorImage *image);
@@ -0,0 +1,133 @@
+#include "format/image/tga.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+int read_tga(const std::byte *file, std::size_t size, TrueColorImage *image)
+{
+	TGAHEADER header;
+
+	// Bogus parameter check
+	if (!(image != nullptr && file != nullptr))
+	{
+		fprintf(stderr, "invalid TGA file\n");
+		return -1000;
+	}
+
+	// Read file header
+	if (size < sizeof header)
+	{
+		return -2;
+	}
+	std::memcpy(&header, file, sizeof header);
+
+	// Only true-color images, raw or run-length encoded
+	if (header.imageType != 2 && header.imageType != 10)
+	{
+		fprintf(stderr, "TGA file not true-color\n");
+		return -3;
+	}
+
+	if (header.pixelDepth != 24 && header.pixelDepth != 32)
+	{
+		fprintf(stderr, "TGA file not 24 or 32 bit\n");
+		return -4;
+	}
+
+	if (header.width == 0 || header.height == 0)
+	{
+		return -5;
+	}
+
+	// Skip the image ID and the color map, unused by true-color images
+	std::size_t offset = sizeof header + header.idLength;
+	if (header.colorMapType == 1)
+	{
+		offset += header.colorMapLength * ((header.colorMapDepth + 7) / 8);
+	}
+
+	const int width = header.width;
+	const int height = header.height;
+	const int bytes = header.pixelDepth / 8;
+	const bool alpha = bytes == 4 && (header.descriptor & 0x0F) != 0;
+	image->width = width;
+	image->height = height;
+	image->rgba.assign(static_cast<std::size_t>(width) * height * 4, 0);
+
+	// Pixels are BGR(A), converted in file order
+	uint8_t *pb = image->rgba.data();
+	uint8_t *pbEnd = pb + image->rgba.size();
+	const auto convert = [&](const std::byte *pixel)
+	{
+		pb[0] = static_cast<uint8_t>(pixel[2]);
+		pb[1] = static_cast<uint8_t>(pixel[1]);
+		pb[2] = static_cast<uint8_t>(pixel[0]);
+		pb[3] = alpha ? static_cast<uint8_t>(pixel[3]) : 255;
+		pb += 4;
+	};
+	if (header.imageType == 2)
+	{
+		if (offset > size || static_cast<std::size_t>(width) * height * bytes > size - offset)
+		{
+			return -6;
+		}
+		for (; pb < pbEnd; offset += bytes)
+		{
+			convert(file + offset);
+		}
+	}
+	else
+	{
+		while (pb < pbEnd)
+		{
+			if (offset >= size)
+			{
+				return -6;
+			}
+			const int packet = static_cast<uint8_t>(file[offset++]);
+			const int count = (packet & 0x7F) + 1;
+			const bool run = packet & 0x80;
+			if ((run ? bytes : count * bytes) > size - offset || count * 4 > pbEnd - pb)
+			{
+				return -7;
+			}
+			for (int i = 0; i < count; i++)
+			{
+				convert(file + offset);
+				if (!run)
+				{
+					offset += bytes;
+				}
+			}
+			if (run)
+			{
+				offset += bytes;
+			}
+		}
+	}
+
+	// Stored bottom row first and left to right unless the descriptor says otherwise
+	const int rowsize = width * 4;
+	uint8_t *pixels = image->rgba.data();
+	if (header.descriptor & 0x20)
+	{
+		for (int top = 0, bottom = height - 1; top < bottom; top++, bottom--)
+		{
+			std::swap_ranges(pixels + top * rowsize, pixels + (top + 1) * rowsize, pixels + bottom * rowsize);
+		}
+	}
+	if (header.descriptor & 0x10)
+	{
+		for (int y = 0; y < height; y++)
+		{
+			uint8_t *row = pixels + y * rowsize;
+			for (int left = 0, right = width - 1; left < right; left++, right--)
+			{
+				std::swap_ranges(row + left * 4, row + left * 4 + 4, row + right * 4);
+			}
+		}
+	}
+
+	return 0;
+}
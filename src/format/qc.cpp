@@ -3,6 +3,7 @@
 #include <iostream>
 
 #include "utils/cmdlib.hpp"
+#include "utils/fileprovider.hpp"
 
 std::vector<char> qc_script_buffer;
 char *qc_stream_p = nullptr;
@@ -13,9 +14,10 @@ int qc_line_number = 0;
 
 void load_qc_file(const std::filesystem::path &filename)
 {
-    qc_script_buffer = load_file(filename);
+    qc_script_buffer = g_fileprovider->load(filename);
+    qc_script_buffer.push_back('\0'); // sentinel, lets the tokenizer peek at *qc_stream_end_p
     qc_stream_p = qc_script_buffer.data();
-    qc_stream_end_p = qc_stream_p + qc_script_buffer.size();
+    qc_stream_end_p = qc_stream_p + qc_script_buffer.size() - 1;
     qc_line_number = 1;
     end_of_qc_file = false;
     token_ready = false;
@@ -63,7 +65,8 @@ bool get_token(bool crossline, std::string &token)
         qc_stream_p++;
         while (*qc_stream_p != '"' && qc_stream_p < qc_stream_end_p)
             token.push_back(*qc_stream_p++);
-        qc_stream_p++;
+        if (qc_stream_p < qc_stream_end_p)
+            qc_stream_p++;
     }
     else
     {
@@ -77,6 +80,8 @@ bool get_token(bool crossline, std::string &token)
 bool token_available()
 {
     char *search_p = qc_stream_p;
+    if (search_p >= qc_stream_end_p)
+        return false;
     while (*search_p <= 32)
     {
         if (*search_p == '\n')
@@ -30,8 +30,8 @@ public:
     std::vector<Animation> sequenceAnimationOptions; // $sequence, each sequence can have 16 blends
 
     std::array<std::array<int, 32>, 32> texturegroups{}; // $texturegroup
-    int texturegroup_rows;
-    int texturegroup_cols;
+    int texturegroup_rows = 0;
+    int texturegroup_cols = 0;
 
     std::array<Vector3, 2> bbox{}; // $bbox
     std::array<Vector3, 2> cbox{}; // $cbox
@@ -42,12 +42,17 @@ public:
 
     std::vector<Sequence> sequences; // $sequence
 
+    std::vector<std::string> sequencegroups{"default"}; // $sequencegroup, labels, group 0 is stored in the model itself
+    int sequencegroupsize = 0;                          // $sequencegroupsize, in bytes, 0 keeps the default group in the model
+
     std::vector<Model *> submodels; // $body
 
     std::vector<BodyPart> bodyparts; // $bodygroup
 
     int flags = 0; // $flags
 
+    bool externaltextures = false; // $externaltextures, textures are written to <model>T.mdl
+
     // Constructor
     QC()
     {
@@ -0,0 +1,175 @@
+#include "smdcache.hpp"
+
+#include <cstring>
+#include <fstream>
+
+#include "utils/cmdlib.hpp"
+
+static void append(std::vector<std::byte> &buffer, const void *data, std::size_t size)
+{
+	const std::byte *bytes = static_cast<const std::byte *>(data);
+	buffer.insert(buffer.end(), bytes, bytes + size);
+}
+
+// Starts a new 8-byte aligned section, returns its offset
+static int begin_section(std::vector<std::byte> &buffer)
+{
+	buffer.resize((buffer.size() + 7) & ~std::size_t{7});
+	return static_cast<int>(buffer.size());
+}
+
+std::size_t save_smd_cache(const std::filesystem::path &path, std::uint64_t hash, const SmdCacheData &data)
+{
+	SmdCacheHeader header{};
+	header.ident = IDSMDCACHEHEADER;
+	header.version = SMDCACHE_VERSION;
+	header.hash = hash;
+	header.firstframe = data.firstframe;
+	header.numframes = static_cast<int>(data.framemask.size());
+	header.lowest = data.lowest;
+
+	std::vector<std::byte> buffer(sizeof(header));
+
+	std::string strings;
+	auto add_string = [&strings](const std::string &str)
+	{
+		const int index = static_cast<int>(strings.size());
+		strings += str;
+		strings += '\0';
+		return index;
+	};
+
+	header.numnodes = static_cast<int>(data.nodes.size());
+	header.nodeindex = begin_section(buffer);
+	for (const auto &node : data.nodes)
+	{
+		SmdCacheNode cached{add_string(node.name), node.parent, node.mirrored};
+		append(buffer, &cached, sizeof(cached));
+	}
+
+	header.numbones = static_cast<int>(data.skeleton.size());
+	header.boneindex = begin_section(buffer);
+	append(buffer, data.skeleton.data(), data.skeleton.size() * sizeof(Bone));
+
+	header.parsedframesindex = begin_section(buffer);
+	std::uint8_t parsedframes[MAXSTUDIOANIMATIONS / 8]{};
+	for (int t = 0; t < MAXSTUDIOANIMATIONS; t++)
+	{
+		if (data.parsedframes[t])
+			parsedframes[t / 8] |= 1 << (t % 8);
+	}
+	append(buffer, parsedframes, sizeof(parsedframes));
+
+	header.framemaskindex = begin_section(buffer);
+	append(buffer, data.framemask.data(), data.framemask.size());
+
+	if (!data.pos.empty())
+	{
+		header.animindex = begin_section(buffer);
+		buffer.resize(buffer.size() + data.pos.size() * sizeof(int));
+		for (std::size_t i = 0; i < data.pos.size(); i++)
+		{
+			const int offset = begin_section(buffer);
+			append(buffer, data.pos[i], header.numframes * sizeof(Vector3));
+			append(buffer, data.rot[i], header.numframes * sizeof(Vector3));
+			std::memcpy(buffer.data() + header.animindex + i * sizeof(int), &offset, sizeof(offset));
+		}
+	}
+
+	header.nummaterials = static_cast<int>(data.materials.size());
+	header.materialindex = begin_section(buffer);
+	for (const auto &material : data.materials)
+	{
+		const int index = add_string(material);
+		append(buffer, &index, sizeof(index));
+	}
+
+	header.numtriangles = static_cast<int>(data.triangles.size());
+	header.triangleindex = begin_section(buffer);
+	append(buffer, data.triangles.data(), data.triangles.size() * sizeof(SmdCacheTriangle));
+
+	header.stringsize = static_cast<int>(strings.size());
+	header.stringindex = begin_section(buffer);
+	append(buffer, strings.data(), strings.size());
+
+	std::memcpy(buffer.data(), &header, sizeof(header));
+
+	std::error_code ec;
+	std::filesystem::create_directories(path.parent_path(), ec);
+	const std::filesystem::path temp = temporary_path(path);
+	std::ofstream file(temp, std::ios::binary);
+	if (!file.write(reinterpret_cast<const char *>(buffer.data()), buffer.size()))
+	{
+		file.close();
+		std::filesystem::remove(temp, ec);
+		return 0;
+	}
+	file.close();
+	std::filesystem::rename(temp, path, ec);
+	if (ec)
+	{
+		std::filesystem::remove(temp, ec);
+		return 0;
+	}
+	return buffer.size();
+}
+
+bool SmdCacheFile::open(const std::filesystem::path &path, std::uint64_t hash)
+{
+	if (!file.open(path) || file.size() < sizeof(SmdCacheHeader))
+		return false;
+
+	const SmdCacheHeader &h = header();
+	if (h.ident != IDSMDCACHEHEADER || h.version != SMDCACHE_VERSION || h.hash != hash)
+		return false;
+
+	// every section has to lie inside the file
+	const auto inside = [this](int index, int count, std::size_t size)
+	{
+		return index >= 0 && count >= 0 && static_cast<std::size_t>(index) + count * size <= file.size();
+	};
+	if (!inside(h.stringindex, h.stringsize, 1) || !inside(h.nodeindex, h.numnodes, sizeof(SmdCacheNode)) ||
+		!inside(h.boneindex, h.numbones, sizeof(Bone)) || !inside(h.materialindex, h.nummaterials, sizeof(int)) ||
+		!inside(h.triangleindex, h.numtriangles, sizeof(SmdCacheTriangle)) ||
+		!inside(h.framemaskindex, h.numframes, 1) || !inside(h.parsedframesindex, MAXSTUDIOANIMATIONS / 8, 1) ||
+		(h.stringsize > 0 && *string(h.stringsize - 1) != '\0'))
+		return false;
+	for (int i = 0; i < h.numnodes; i++)
+	{
+		const SmdCacheNode &node = at<SmdCacheNode>(h.nodeindex)[i];
+		if (node.nameindex < 0 || node.nameindex >= h.stringsize || node.parent < -1 || node.parent >= h.numnodes)
+			return false;
+	}
+	for (int i = 0; i < h.nummaterials; i++)
+	{
+		const int index = at<int>(h.materialindex)[i];
+		if (index < 0 || index >= h.stringsize)
+			return false;
+	}
+	for (int i = 0; i < h.numtriangles; i++)
+	{
+		const SmdCacheTriangle &triangle = at<SmdCacheTriangle>(h.triangleindex)[i];
+		if (triangle.material < 0 || triangle.material >= h.nummaterials)
+			return false;
+		for (const auto &vert : triangle.verts)
+		{
+			if (vert.bone < 0 || vert.bone >= h.numnodes)
+				return false;
+		}
+	}
+	if (h.animindex)
+	{
+		if (!inside(h.animindex, h.numnodes, sizeof(int)))
+			return false;
+		const int *offsets = at<int>(h.animindex);
+		for (int i = 0; i < h.numnodes; i++)
+		{
+			if (!inside(offsets[i], h.numframes * 2, sizeof(Vector3)))
+				return false;
+		}
+	}
+	// the modification time tracks use for size-bounded caches
+	std::error_code ec;
+	std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ec);
+	return true;
+}
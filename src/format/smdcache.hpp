@@ -0,0 +1,110 @@
+#pragma once
+
+#include <bitset>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "modeldata.hpp"
+#include "utils/mappedfile.hpp"
+#include "utils/mathlib.hpp"
+
+// Binary cache of parsed SMD files
+
+// --- Magic Numbers and Version ---
+constexpr int SMDCACHE_VERSION = 3;
+constexpr int IDSMDCACHEHEADER = (('C' << 24) + ('D' << 16) + ('M' << 8) + 'S'); // little-endian "SMDC"
+
+// --- Structure Definitions --- //
+
+/**
+ * Header of a parsed SMD cache file.
+ *
+ * Like the .mdl format every section is a flat array at an offset from the start of the file,
+ * so a mapped file is read in place. Positions are stored after every QC transform was applied.
+ */
+struct SmdCacheHeader
+{
+	int ident;			// IDSMDCACHEHEADER = "SMDC"
+	int version;		// SMDCACHE_VERSION
+	std::uint64_t hash; // hash of the SMD file
+
+	int stringsize; // NUL terminated names
+	int stringindex;
+
+	int numnodes; // SmdCacheNode
+	int nodeindex;
+
+	int numbones; // Bone, reference skeleton
+	int boneindex;
+
+	int parsedframesindex; // MAXSTUDIOANIMATIONS bits, set for the times whose blocks were parsed
+	int firstframe;		// time of the first animation frame
+	int numframes;		// frames from firstframe to the last time block
+	int framemaskindex; // numframes bytes, 1 if the SMD has a time block for the frame
+	int animindex;		// numnodes ints, offset of pos[numframes] followed by rot[numframes], 0 if not an animation
+
+	int nummaterials; // ints, string offsets
+	int materialindex;
+
+	int numtriangles; // SmdCacheTriangle
+	int triangleindex;
+
+	float lowest; // lowest vertex z of the reference
+};
+
+struct SmdCacheNode
+{
+	int nameindex;
+	int parent;
+	int mirrored;
+};
+
+struct SmdCacheVertex
+{
+	int bone;
+	Vector3 pos;	// object space position
+	Vector3 normal; // object space normal
+	float u, v;
+};
+
+struct SmdCacheTriangle
+{
+	int material;
+	SmdCacheVertex verts[3]; // in file order
+};
+
+// Parsed SMD contents to be written to a cache file
+struct SmdCacheData
+{
+	std::vector<Node> nodes;
+	std::vector<Bone> skeleton;
+	std::bitset<MAXSTUDIOANIMATIONS> parsedframes;
+	int firstframe = 0;
+	std::vector<std::uint8_t> framemask; // [frame]
+	std::vector<const Vector3 *> pos;	 // [node][frame], empty if not an animation
+	std::vector<const Vector3 *> rot;
+	std::vector<std::string> materials;
+	std::vector<SmdCacheTriangle> triangles;
+	float lowest = 0.0f;
+};
+
+// Writes under a temporary name, then renames, so readers never see a partial file.
+// Failures are ignored, the SMD is parsed again next time. Returns the size of the file written, 0 if it failed
+std::size_t save_smd_cache(const std::filesystem::path &path, std::uint64_t hash, const SmdCacheData &data);
+
+class SmdCacheFile
+{
+public:
+	// Returns false if the file is missing, corrupt, or was made from different SMD contents
+	bool open(const std::filesystem::path &path, std::uint64_t hash);
+
+	const SmdCacheHeader &header() const { return *reinterpret_cast<const SmdCacheHeader *>(file.data()); }
+	const char *string(int index) const { return reinterpret_cast<const char *>(file.data() + header().stringindex + index); }
+	template <typename T>
+	const T *at(int offset) const { return reinterpret_cast<const T *>(file.data() + offset); }
+
+private:
+	MappedFile file;
+};
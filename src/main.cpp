@@ -0,0 +1,72 @@
+// main.cpp: studiomdl++ command line front end
+
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "driver.hpp"
+#include "outputcache.hpp"
+#include "server.hpp"
+#include "watch.hpp"
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		usage(argv[0]);
+	}
+
+	std::vector<std::string> args(argv + 1, argv + argc);
+	const char *cache_dir = std::getenv("STUDIOMDL_CACHE_DIR");
+	if (cache_dir && *cache_dir && std::find(args.begin(), args.end(), "--cache-dir") == args.end())
+	{
+		// passed on explicitly so a compile server uses the same cache
+		args.push_back("--cache-dir");
+		args.push_back(std::filesystem::absolute(cache_dir).string());
+	}
+	Options options = parse_options(args);
+
+	if (options.cache_stats && options.input.qc_path.empty())
+	{
+		OutputCache(options.cache_dir, options.cache_size).print_stats();
+		return 0;
+	}
+
+	if (options.socket_path.empty())
+	{
+		options.socket_path = default_socket_path();
+	}
+
+	if (options.serve)
+	{
+		run_server(options.socket_path);
+		return 0;
+	}
+
+	if (options.watch)
+	{
+		run_watch(options);
+		return 0;
+	}
+
+	int exit_code;
+	if (!options.no_server && forward_to_server(options.socket_path, args, exit_code))
+	{
+		if (options.cache_stats)
+		{
+			OutputCache(options.cache_dir, options.cache_size).print_stats();
+		}
+		return exit_code;
+	}
+
+	run_compile(options);
+
+	if (options.cache_stats)
+	{
+		OutputCache(options.cache_dir, options.cache_size).print_stats();
+	}
+
+	return 0;
+}
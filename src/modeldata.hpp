@@ -157,8 +157,6 @@ struct Texture
     int flags;
     int srcwidth;
     int srcheight;
-    std::uint8_t *ppicture;
-    RGB *ppal;
     float max_s;
     float min_s;
     float max_t;
@@ -0,0 +1,389 @@
+// outputcache.cpp: content-addressed cache of compiled models
+
+#include "outputcache.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+
+#include "utils/cmdlib.hpp"
+#include "utils/fileprovider.hpp"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+
+constexpr const char *MANIFEST_HEADER = "studiomdl++ manifest 2";
+
+static std::string to_hex(std::uint64_t value)
+{
+	char text[17];
+	std::snprintf(text, sizeof(text), "%016llx", static_cast<unsigned long long>(value));
+	return text;
+}
+
+// Anything that identifies the compiler build, so a rebuilt compiler never reuses old outputs
+static std::string compiler_identity()
+{
+	std::string identity = "studiomdl++ " __DATE__ " " __TIME__;
+#ifdef __linux__
+	std::error_code ec;
+	const std::filesystem::path exe = std::filesystem::read_symlink("/proc/self/exe", ec);
+	if (!ec)
+	{
+		const auto size = std::filesystem::file_size(exe, ec);
+		const auto mtime = std::filesystem::last_write_time(exe, ec).time_since_epoch().count();
+		identity += " " + std::to_string(size) + " " + std::to_string(mtime);
+	}
+#endif
+	return identity;
+}
+
+// Every CompileInput option that changes the output
+static std::string options_key(const CompileInput &input)
+{
+	std::string key;
+	key += input.invert_normals ? "f" : "-";
+	key += input.keep_all_bones ? "b" : "-";
+	key.append((const char *)&input.normal_blend_angle, sizeof(input.normal_blend_angle));
+	key.append((const char *)&input.anim_tolerance_pos, sizeof(input.anim_tolerance_pos));
+	key.append((const char *)&input.anim_tolerance_rot, sizeof(input.anim_tolerance_rot));
+	key.append((const char *)&input.sequence_group_size, sizeof(input.sequence_group_size));
+	key += input.external_textures ? "t" : "-";
+	key += input.dither_textures ? "d" : "-";
+	key.append((const char *)&input.max_texture_dim, sizeof(input.max_texture_dim));
+	key.append((const char *)&input.texture_budget, sizeof(input.texture_budget));
+	key.append((const char *)&input.section_align, sizeof(input.section_align));
+	return key;
+}
+
+static FileProvider &input_files(const CompileInput &input)
+{
+	return input.files ? *input.files : *g_fileprovider;
+}
+
+OutputCache::OutputCache(const std::filesystem::path &dir, std::uintmax_t max_size)
+	: dir(std::filesystem::absolute(dir)), max_size(max_size)
+{
+	std::filesystem::create_directories(this->dir / "manifests");
+}
+
+std::string OutputCache::qc_key(const CompileInput &input)
+{
+	const std::filesystem::path qc_path = std::filesystem::absolute(input.qc_path).lexically_normal();
+	std::string key = compiler_identity() + '\n' + options_key(input) + '\n' + qc_path.generic_string() + '\n';
+	const std::vector<char> qc = input_files(input).load(qc_path);
+	key.append(qc.data(), qc.size());
+	return to_hex(hash_bytes(key.data(), key.size()));
+}
+
+std::string OutputCache::model_key(const CompileInput &input, const std::string &qc_key,
+								   const std::vector<std::filesystem::path> &dependencies)
+{
+	std::string key = qc_key;
+	for (const auto &dependency : dependencies)
+	{
+		const std::vector<char> data = input_files(input).load(dependency);
+		key += '\n' + dependency.generic_string() + ' ' + to_hex(hash_bytes(data.data(), data.size()));
+	}
+	// two differently seeded hashes, 128 bits of key
+	return to_hex(hash_bytes(key.data(), key.size(), 1)) + to_hex(hash_bytes(key.data(), key.size(), 2));
+}
+
+struct CacheStats
+{
+	long long hits = 0;
+	long long misses = 0;
+	std::uintmax_t size = 0; // bytes of models, parsed SMDs and quantized textures
+	bool size_known = false; // false until the first scan
+};
+
+static CacheStats read_stats(const std::filesystem::path &dir)
+{
+	CacheStats stats;
+	std::ifstream file(dir / "stats");
+	std::string name;
+	unsigned long long value;
+	while (file >> name >> value)
+	{
+		if (name == "hits")
+			stats.hits = static_cast<long long>(value);
+		else if (name == "misses")
+			stats.misses = static_cast<long long>(value);
+		else if (name == "size")
+		{
+			stats.size = value;
+			stats.size_known = true;
+		}
+	}
+	return stats;
+}
+
+// Replaced atomically so readers never see the file truncated
+static void write_stats(const std::filesystem::path &dir, const CacheStats &stats)
+{
+	std::string text = "hits " + std::to_string(stats.hits) + "\nmisses " + std::to_string(stats.misses) + "\n";
+	if (stats.size_known)
+		text += "size " + std::to_string(stats.size) + "\n";
+	write_atomically(dir / "stats", text.data(), text.size());
+}
+
+// Builds sharing the cache update the stats file while holding this lock, closing the lock file releases it
+class StatsLock
+{
+public:
+	explicit StatsLock(const std::filesystem::path &dir)
+	{
+#ifdef __linux__
+		const std::filesystem::path lock_path = dir / "stats.lock";
+		fd = open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (fd >= 0)
+			flock(fd, LOCK_EX);
+#endif
+	}
+	~StatsLock()
+	{
+#ifdef __linux__
+		if (fd >= 0)
+			close(fd);
+#endif
+	}
+
+private:
+	int fd = -1;
+};
+
+bool OutputCache::lookup(const CompileInput &input, std::vector<std::filesystem::path> &cached_files,
+						 std::vector<std::filesystem::path> &dependencies, bool &external_textures)
+{
+	const std::string key = qc_key(input);
+	std::ifstream manifest(dir / "manifests" / key);
+	std::string line;
+	std::string textures;
+	if (!manifest || !std::getline(manifest, line) || line != MANIFEST_HEADER || !std::getline(manifest, textures) ||
+		(textures != "external-textures 0" && textures != "external-textures 1"))
+	{
+		add_stat(false);
+		return false;
+	}
+	external_textures = textures.back() == '1';
+
+	dependencies.clear();
+	while (std::getline(manifest, line))
+	{
+		if (!input_files(input).exists(line))
+		{
+			add_stat(false);
+			return false;
+		}
+		dependencies.emplace_back(line);
+	}
+
+	const std::filesystem::path cached_mdl = dir / (model_key(input, key, dependencies) + ".mdl");
+	StudioHeader header{};
+	std::ifstream cached(cached_mdl, std::ios::binary);
+	if (!cached.read(reinterpret_cast<char *>(&header), sizeof(header)))
+	{
+		add_stat(false);
+		return false;
+	}
+	cached_files = model_files(cached_mdl, header, external_textures);
+	for (const auto &file : cached_files)
+	{
+		std::error_code ec;
+		std::filesystem::last_write_time(file, std::filesystem::file_time_type::clock::now(), ec); // LRU touch
+		if (ec)
+		{
+			add_stat(false);
+			return false;
+		}
+	}
+
+	add_stat(true);
+	return true;
+}
+
+void OutputCache::store(const CompileInput &input, const std::vector<std::byte> &mdl,
+						const std::vector<std::vector<std::byte>> &sequence_groups, const std::vector<std::byte> &texture_model,
+						const std::vector<std::filesystem::path> &dependencies, std::uintmax_t other_bytes)
+{
+	const std::string key = qc_key(input);
+	const std::filesystem::path cached_mdl = dir / (model_key(input, key, dependencies) + ".mdl");
+
+	// every file is renamed into place complete, and the model goes last, a lookup that finds it finds its other files too
+	if (!texture_model.empty())
+	{
+		write_atomically(texture_model_path(cached_mdl), texture_model.data(), texture_model.size());
+	}
+	for (std::size_t i = 0; i < sequence_groups.size(); i++)
+	{
+		write_atomically(sequence_group_path(cached_mdl, static_cast<int>(i) + 1), sequence_groups[i].data(), sequence_groups[i].size());
+	}
+	write_atomically(cached_mdl, mdl.data(), mdl.size());
+
+	std::string text = std::string(MANIFEST_HEADER) + '\n';
+	text += std::string("external-textures ") + (texture_model.empty() ? "0" : "1") + '\n';
+	for (const auto &dependency : dependencies)
+	{
+		text += dependency.generic_string() + '\n';
+	}
+	write_atomically(dir / "manifests" / key, text.data(), text.size());
+
+	std::uintmax_t added = mdl.size() + texture_model.size() + other_bytes;
+	for (const auto &group : sequence_groups)
+	{
+		added += group.size();
+	}
+
+	// the running size only grows here (rewritten entries are counted twice), the tree is scanned and the
+	// size corrected when it goes over the limit
+	StatsLock lock(dir);
+	CacheStats stats = read_stats(dir);
+	if (stats.size_known && stats.size + added <= max_size)
+	{
+		stats.size += added;
+	}
+	else
+	{
+		stats.size = evict();
+		stats.size_known = true;
+	}
+	write_stats(dir, stats);
+}
+
+void OutputCache::add_stat(bool hit)
+{
+	StatsLock lock(dir);
+	CacheStats stats = read_stats(dir);
+	(hit ? stats.hits : stats.misses)++;
+	write_stats(dir, stats);
+}
+
+// Models, parsed SMDs and quantized textures are evicted alike
+static bool is_cache_entry(const std::filesystem::directory_entry &file)
+{
+	const std::filesystem::path extension = file.path().extension();
+	std::error_code ec;
+	return file.is_regular_file(ec) && (extension == ".mdl" || extension == ".smdc" || extension == ".bmp");
+}
+
+// Deletes the least recently used entries until the cache is back under 90% of its size limit, returns the size left
+std::uintmax_t OutputCache::evict()
+{
+	struct Entry
+	{
+		std::filesystem::file_time_type mtime;
+		std::uintmax_t size;
+		std::filesystem::path path;
+	};
+	std::vector<Entry> entries;
+	std::uintmax_t total = 0;
+	// other builds sharing the cache may evict the same entries meanwhile, entries that vanished are skipped
+	std::error_code ec;
+	for (std::filesystem::recursive_directory_iterator file(dir, ec), end; !ec && file != end; file.increment(ec))
+	{
+		if (!is_cache_entry(*file))
+			continue;
+		std::error_code entry_ec;
+		const std::filesystem::file_time_type mtime = file->last_write_time(entry_ec);
+		const std::uintmax_t size = entry_ec ? 0 : file->file_size(entry_ec);
+		if (entry_ec)
+			continue;
+		entries.push_back({mtime, size, file->path()});
+		total += size;
+	}
+	if (total <= max_size)
+		return total;
+
+	std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b)
+			  { return a.mtime < b.mtime; });
+	for (const auto &entry : entries)
+	{
+		if (total <= max_size / 10 * 9)
+			break;
+		if (std::filesystem::remove(entry.path, ec))
+			total -= entry.size;
+	}
+	return total;
+}
+
+void OutputCache::print_stats()
+{
+	const CacheStats stats = read_stats(dir);
+
+	int models = 0;
+	int smds = 0;
+	int textures = 0;
+	std::uintmax_t total = 0;
+	for (const auto &file : std::filesystem::recursive_directory_iterator(dir))
+	{
+		if (is_cache_entry(file))
+		{
+			const std::filesystem::path extension = file.path().extension();
+			(extension == ".mdl" ? models : extension == ".smdc" ? smds : textures)++;
+			total += file.file_size();
+		}
+	}
+
+	printf("cache directory  %s\n", dir.string().c_str());
+	printf("hits             %lld\n", stats.hits);
+	printf("misses           %lld\n", stats.misses);
+	printf("hit rate         %.1f%%\n", stats.hits + stats.misses ? 100.0 * stats.hits / (stats.hits + stats.misses) : 0.0);
+	printf("models           %d\n", models);
+	printf("parsed SMDs      %d\n", smds);
+	printf("textures         %d\n", textures);
+	printf("size             %.1f / %.1f MB\n", total / (1024.0 * 1024.0), max_size / (1024.0 * 1024.0));
+}
+
+std::filesystem::path sequence_group_path(const std::filesystem::path &mdl, int group)
+{
+	char number[16];
+	std::snprintf(number, sizeof(number), "%02d", group);
+	std::filesystem::path path = mdl;
+	path.replace_filename(mdl.stem().string() + number + ".mdl");
+	return path;
+}
+
+std::filesystem::path texture_model_path(const std::filesystem::path &mdl)
+{
+	std::filesystem::path path = mdl;
+	path.replace_filename(mdl.stem().string() + "T.mdl");
+	return path;
+}
+
+std::vector<std::filesystem::path> model_files(const std::filesystem::path &mdl, const StudioHeader &header, bool external_textures)
+{
+	std::vector<std::filesystem::path> files{mdl};
+	if (external_textures)
+	{
+		files.push_back(texture_model_path(mdl));
+	}
+	for (int group = 1; group < header.numseqgroups; group++)
+	{
+		files.push_back(sequence_group_path(mdl, group));
+	}
+	return files;
+}
+
+void copy_or_reflink(const std::filesystem::path &from, const std::filesystem::path &to)
+{
+#if defined(__linux__) && defined(FICLONE)
+	int source = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+	if (source >= 0)
+	{
+		int dest = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		bool cloned = dest >= 0 && ioctl(dest, FICLONE, source) == 0;
+		if (dest >= 0)
+			close(dest);
+		close(source);
+		if (cloned)
+			return;
+	}
+#endif
+	std::filesystem::copy_file(from, to, std::filesystem::copy_options::overwrite_existing);
+}
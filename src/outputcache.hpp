@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "compile.hpp"
+#include "format/mdl.hpp"
+
+// Local cache of compiled models, addressed by the contents of every input
+// (QC, SMDs, BMPs), the compile options and the compiler build.
+//
+// <dir>/manifests/<qc key>  whether the textures are external and the dependencies of the last compile of a QC
+// <dir>/<model key>.mdl     compiled model, mtime is the LRU timestamp
+// <dir>/<model key>T.mdl    its texture model, if the textures are external
+// <dir>/<model key>NN.mdl   its sequence group files, if any
+// <dir>/smd/*.smdc          parsed SMD files, see format/smdcache.hpp
+// <dir>/tex/*.bmp           quantized true-color textures
+// <dir>/stats               hit/miss counters and the running size of the entries above
+class OutputCache
+{
+public:
+    OutputCache(const std::filesystem::path &dir, std::uintmax_t max_size);
+
+    // Finds the compiled model for the current inputs, fills dependencies and external_textures on a hit.
+    // cached_files receives the model_files() of the cached model
+    bool lookup(const CompileInput &input, std::vector<std::filesystem::path> &cached_files, std::vector<std::filesystem::path> &dependencies,
+                bool &external_textures);
+    // other_bytes: written to the SMD and texture cache directories by the compile, counted in the cache size
+    void store(const CompileInput &input, const std::vector<std::byte> &mdl, const std::vector<std::vector<std::byte>> &sequence_groups,
+               const std::vector<std::byte> &texture_model, const std::vector<std::filesystem::path> &dependencies,
+               std::uintmax_t other_bytes);
+
+    void print_stats();
+
+private:
+    std::string qc_key(const CompileInput &input);
+    std::string model_key(const CompileInput &input, const std::string &qc_key, const std::vector<std::filesystem::path> &dependencies);
+    void add_stat(bool hit);
+    std::uintmax_t evict();
+
+    std::filesystem::path dir;
+    std::uintmax_t max_size;
+};
+
+// <model>NN.mdl next to the model, the file of sequence group NN
+std::filesystem::path sequence_group_path(const std::filesystem::path &mdl, int group);
+
+// <model>T.mdl next to the model, the file of its external textures
+std::filesystem::path texture_model_path(const std::filesystem::path &mdl);
+
+// The model followed by its texture model, if the textures are external, and the sequence group files its header refers to
+std::vector<std::filesystem::path> model_files(const std::filesystem::path &mdl, const StudioHeader &header, bool external_textures);
+
+// Copies the file, sharing its blocks (reflink) when the filesystem supports it
+void copy_or_reflink(const std::filesystem::path &from, const std::filesystem::path &to);
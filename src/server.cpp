@@ -0,0 +1,337 @@
+// server.cpp: compile server keeping parsed inputs in memory between compiles
+
+#include "server.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "compile.hpp"
+#include "driver.hpp"
+#include "utils/cmdlib.hpp"
+#include "utils/fileprovider.hpp"
+
+#ifndef _WIN32
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+std::filesystem::path default_socket_path()
+{
+	if (const char *runtime_dir = std::getenv("XDG_RUNTIME_DIR"))
+	{
+		return std::filesystem::path(runtime_dir) / "studiomdl++.sock";
+	}
+#ifndef _WIN32
+	return std::filesystem::temp_directory_path() / ("studiomdl++-" + std::to_string(getuid()) + ".sock");
+#else
+	return std::filesystem::temp_directory_path() / "studiomdl++.sock";
+#endif
+}
+
+#ifndef _WIN32
+
+static std::vector<std::string> split_fields(const std::string &line)
+{
+	std::vector<std::string> fields;
+	std::size_t start = 0;
+	while (true)
+	{
+		std::size_t end = line.find('\t', start);
+		fields.push_back(line.substr(start, end - start));
+		if (end == std::string::npos)
+			break;
+		start = end + 1;
+	}
+	return fields;
+}
+
+static std::string join_fields(const std::vector<std::string> &fields)
+{
+	std::string line;
+	for (const auto &field : fields)
+	{
+		if (!line.empty())
+			line += '\t';
+		line += field;
+	}
+	return line + '\n';
+}
+
+static bool send_all(int fd, const std::string &data)
+{
+	std::size_t sent = 0;
+	while (sent < data.size())
+	{
+		ssize_t n = send(fd, data.data() + sent, data.size() - sent, 0);
+		if (n <= 0)
+			return false;
+		sent += n;
+	}
+	return true;
+}
+
+static bool receive_line(int fd, std::string &line)
+{
+	line.clear();
+	char c;
+	while (recv(fd, &c, 1, 0) == 1)
+	{
+		if (c == '\n')
+			return true;
+		line.push_back(c);
+	}
+	return !line.empty();
+}
+
+static sockaddr_un make_address(const std::filesystem::path &socket_path)
+{
+	sockaddr_un address{};
+	address.sun_family = AF_UNIX;
+	const std::string path = socket_path.string();
+	if (path.size() >= sizeof(address.sun_path))
+	{
+		error("Socket path too long: " + path);
+	}
+	std::strcpy(address.sun_path, path.c_str());
+	return address;
+}
+
+static int connect_to_server(const std::filesystem::path &socket_path)
+{
+	sockaddr_un address = make_address(socket_path);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (sockaddr *)&address, sizeof(address)) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Newlines, tabs and backslashes of the compile log escaped so it fits in one response field
+static std::string escape_field(const std::string &text)
+{
+	std::string escaped;
+	for (char c : text)
+	{
+		if (c == '\\')
+			escaped += "\\\\";
+		else if (c == '\n')
+			escaped += "\\n";
+		else if (c == '\t')
+			escaped += "\\t";
+		else
+			escaped += c;
+	}
+	return escaped;
+}
+
+static std::string unescape_field(const std::string &field)
+{
+	std::string text;
+	for (std::size_t i = 0; i < field.size(); i++)
+	{
+		if (field[i] != '\\' || i + 1 == field.size())
+		{
+			text += field[i];
+			continue;
+		}
+		const char c = field[++i];
+		text += c == 'n' ? '\n' : c == 't' ? '\t' : c;
+	}
+	return text;
+}
+
+// Sends everything printed while it exists to a temporary file instead of stdout, so the compile log can be returned
+// to the client. The log is echoed on the server's own stdout too
+class StdoutCapture
+{
+public:
+	StdoutCapture()
+	{
+		fflush(stdout);
+		file = std::tmpfile();
+		saved = file ? dup(STDOUT_FILENO) : -1;
+		if (saved >= 0)
+			dup2(fileno(file), STDOUT_FILENO);
+	}
+	~StdoutCapture() { finish(); }
+
+	std::string finish()
+	{
+		std::string log;
+		if (saved < 0)
+			return log;
+		fflush(stdout);
+		dup2(saved, STDOUT_FILENO);
+		close(saved);
+		saved = -1;
+		std::rewind(file);
+		char buffer[4096];
+		std::size_t n;
+		while ((n = std::fread(buffer, 1, sizeof(buffer), file)) > 0)
+			log.append(buffer, n);
+		std::fclose(file);
+		file = nullptr;
+		fwrite(log.data(), 1, log.size(), stdout);
+		return log;
+	}
+
+private:
+	std::FILE *file = nullptr;
+	int saved = -1;
+};
+
+static std::string handle_request(const std::vector<std::string> &fields, CachedDiskFileProvider &files, CompileCache &cache)
+{
+	if (fields.size() < 2 || fields[0] != "compile")
+	{
+		return "error\tMalformed request";
+	}
+
+	const auto start = std::chrono::steady_clock::now();
+	const int file_hits = files.hits, file_misses = files.misses;
+	const int texture_hits = cache.texture_hits, texture_misses = cache.texture_misses;
+	const int animation_hits = cache.animation_hits, animation_misses = cache.animation_misses;
+	const int sequence_hits = cache.sequence_hits, sequence_misses = cache.sequence_misses;
+
+	StdoutCapture capture;
+	try
+	{
+		std::filesystem::current_path(fields[1]);
+		Options options = parse_options(std::vector<std::string>(fields.begin() + 2, fields.end()));
+		options.input.files = &files;
+		options.input.cache = &cache;
+		const std::size_t size = run_compile(options);
+		const std::string log = capture.finish();
+
+		const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+		const std::string stats =
+			"files " + std::to_string(files.hits - file_hits) + "/" + std::to_string(files.hits - file_hits + files.misses - file_misses) + " in memory, " +
+			"animations " + std::to_string(cache.animation_hits - animation_hits) + "/" + std::to_string(cache.animation_hits - animation_hits + cache.animation_misses - animation_misses) + " reused, " +
+			"sequences " + std::to_string(cache.sequence_hits - sequence_hits) + "/" + std::to_string(cache.sequence_hits - sequence_hits + cache.sequence_misses - sequence_misses) + " reused, " +
+			"textures " + std::to_string(cache.texture_hits - texture_hits) + "/" + std::to_string(cache.texture_hits - texture_hits + cache.texture_misses - texture_misses) + " reused";
+		return join_fields({"ok", std::to_string(size), std::to_string(elapsed.count()), stats, escape_field(log)});
+	}
+	catch (const std::exception &e)
+	{
+		const std::string log = capture.finish();
+		std::string message = e.what();
+		std::replace(message.begin(), message.end(), '\n', ' ');
+		std::replace(message.begin(), message.end(), '\t', ' ');
+		printf("%s\n", message.c_str());
+		return join_fields({"error", message, escape_field(log)});
+	}
+}
+
+void run_server(const std::filesystem::path &socket_path)
+{
+	int fd = connect_to_server(socket_path);
+	if (fd >= 0)
+	{
+		close(fd);
+		error("A compile server is already listening on " + socket_path.string());
+	}
+	std::filesystem::remove(socket_path); // stale socket of a server that didn't exit cleanly
+
+	sockaddr_un address = make_address(socket_path);
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0 || bind(listen_fd, (sockaddr *)&address, sizeof(address)) != 0 || listen(listen_fd, 16) != 0)
+	{
+		error("Cannot listen on " + socket_path.string());
+	}
+
+	// a client going away mid-response must not kill the server
+	std::signal(SIGPIPE, SIG_IGN);
+
+	CachedDiskFileProvider files;
+	CompileCache cache;
+
+	printf("Compile server listening on %s\n", socket_path.string().c_str());
+	fflush(stdout);
+
+	while (true)
+	{
+		int client_fd = accept(listen_fd, nullptr, nullptr);
+		if (client_fd < 0)
+			continue;
+
+		std::string line;
+		if (receive_line(client_fd, line))
+		{
+			std::string response = handle_request(split_fields(line), files, cache);
+			// inputs deleted since they were read, files past the size limit are already gone
+			files.prune();
+			prune_compile_cache(cache);
+			if (response.back() != '\n')
+				response += '\n';
+			send_all(client_fd, response);
+		}
+		close(client_fd);
+		fflush(stdout);
+	}
+}
+
+bool forward_to_server(const std::filesystem::path &socket_path, const std::vector<std::string> &args, int &exit_code)
+{
+	if (!std::filesystem::exists(socket_path))
+		return false;
+
+	int fd = connect_to_server(socket_path);
+	if (fd < 0)
+		return false;
+
+	std::vector<std::string> fields{"compile", std::filesystem::current_path().string()};
+	fields.insert(fields.end(), args.begin(), args.end());
+	std::string line;
+	if (!send_all(fd, join_fields(fields)) || !receive_line(fd, line))
+	{
+		close(fd);
+		error("Compile server on " + socket_path.string() + " did not answer");
+	}
+	close(fd);
+
+	// the compile log first, as a local compile would have printed it
+	std::vector<std::string> response = split_fields(line);
+	const std::size_t log_field = response[0] == "ok" ? 4 : 2;
+	if (response.size() > log_field)
+	{
+		const std::string log = unescape_field(response[log_field]);
+		fwrite(log.data(), 1, log.size(), stdout);
+		fflush(stdout);
+	}
+	if (response[0] == "ok" && response.size() >= 4)
+	{
+		printf("Compiled by server %s: %s bytes in %s ms (%s)\n", socket_path.string().c_str(),
+			   response[1].c_str(), response[2].c_str(), response[3].c_str());
+		exit_code = EXIT_SUCCESS;
+	}
+	else
+	{
+		fprintf(stderr, "%s\n", response.size() >= 2 ? response[1].c_str() : line.c_str());
+		exit_code = EXIT_FAILURE;
+	}
+	return true;
+}
+
+#else
+
+void run_server(const std::filesystem::path &socket_path)
+{
+	error("--serve is not supported on this platform");
+}
+
+bool forward_to_server(const std::filesystem::path &socket_path, const std::vector<std::string> &args, int &exit_code)
+{
+	return false;
+}
+
+#endif
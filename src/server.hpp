@@ -0,0 +1,22 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// Compile server: a long-lived studiomdl++ process listening on a local Unix socket.
+//
+// Protocol, one request per connection, fields separated by tabs:
+//   request:  compile <working dir> <arguments...>\n
+//   response: ok <file size> <milliseconds> <stats> <log>\n
+//             error <message> <log>\n
+// <log> is everything the compile printed, with backslashes, newlines and tabs escaped as \\, \n and \t.
+// The server writes the .mdl itself, exactly like a local compile.
+
+std::filesystem::path default_socket_path();
+
+// Serves compile requests until the process is killed
+void run_server(const std::filesystem::path &socket_path);
+
+// Sends the command line to a running server, false if no server is listening
+bool forward_to_server(const std::filesystem::path &socket_path, const std::vector<std::string> &args, int &exit_code);
@@ -1,34 +1,55 @@
 // studiomdl.cpp: generates a studio .mdl file from a .qc script
 
 #include "studiomdl.hpp"
+#include "compile.hpp"
 
 #include <algorithm>
+#include <atomic>
+#include <cfloat>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <sstream>
 #include <string>
 #include <cmath>
 #include <cstdint>
+#include <tuple>
+#include <utility>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "format/image/bmp.hpp"
+#include "format/image/quantize.hpp"
+#include "format/image/tga.hpp"
 #include "format/mdl.hpp"
+#include "format/smdcache.hpp"
 #include "format/qc.hpp"
 #include "monsters/activity.hpp"
 #include "monsters/activitymap.hpp"
 #include "utils/cmdlib.hpp"
+#include "utils/convexhull.hpp"
+#include "utils/fileprovider.hpp"
+#include "utils/mappedfile.hpp"
 #include "utils/mathlib.hpp"
+#include "utils/parallel.hpp"
 #include "writemdl.hpp"
 
 // studiomdl.exe args -----------
 bool g_flaginvertnormals = false;
 bool g_flagkeepallbones = false;
 float g_flagnormalblendangle = std::cos(to_radians(2.0f)); // threshold of 2°
+float g_animtolerancepos = 0.0f; // --anim-tolerance pos=, in units
+float g_animtolerancerot = 0.0f; // --anim-tolerance rot=, in radians
+bool g_flagdithertextures = false; // --dither
+int g_maxtexturedim = 0;		   // --max-texture-dim, 0 keeps the source size
+int g_texturebudget = 0;		   // --texture-budget, in texels for the whole model, 0 for no limit
+int g_sectionalign = 4;				   // --align, in bytes
 
 // SMD variables --------------------------
-FILE *g_smdfile;
+std::vector<char> g_smdbuffer;
+std::size_t g_smdposition;
 char g_currentsmdline[1024];
 int g_smdlinecount;
 
@@ -50,7 +71,59 @@ int g_skinfamiliescount;
 std::unordered_map<uint64_t, int> g_unique_vertices;
 std::unordered_map<uint64_t, std::vector<int>> g_unique_normals;
 
+std::vector<Vector3 *> g_defaultanimations; // dummy animations of bones missing in a sequence
+
+CompileCache *g_compilecache = nullptr;
+std::string g_compileqcpath; // normalized path of the QC being compiled, cached sequences are kept per QC
+std::unordered_map<std::string, CachedAnimation> g_compileanimations; // parsed SMDs of this compile when there's no cache
+std::unordered_set<std::string> g_checkedanimations;				  // animation keys checked against the SMD this compile
+std::filesystem::path g_smdcachedir; // binary cache of parsed SMD files, empty if disabled
+std::filesystem::path g_texturecachedir; // quantized true-color textures, empty if disabled
+std::atomic<std::uintmax_t> g_cachebyteswritten; // to the SMD and texture cache directories this compile
+
 // ---------------------------------------
+static void load_smd_file(const std::filesystem::path &path)
+{
+	g_smdbuffer = g_fileprovider->load(path);
+	g_smdposition = 0;
+}
+
+// Reads the next SMD line into g_currentsmdline like fgets, false at end of file
+static bool read_smd_line()
+{
+	if (g_smdposition >= g_smdbuffer.size())
+		return false;
+
+	std::size_t count = 0;
+	while (g_smdposition < g_smdbuffer.size() && count < sizeof(g_currentsmdline) - 1)
+	{
+		const char c = g_smdbuffer[g_smdposition++];
+		g_currentsmdline[count++] = c;
+		if (c == '\n')
+			break;
+	}
+	g_currentsmdline[count] = '\0';
+	return true;
+}
+
+// Skips the bone lines of an SMD time block without parsing them, stopping before the next keyword line
+static void skip_smd_frame()
+{
+	const char *data = g_smdbuffer.data();
+	const std::size_t size = g_smdbuffer.size();
+	while (g_smdposition < size)
+	{
+		std::size_t p = g_smdposition;
+		while (p < size && (data[p] == ' ' || data[p] == '\t'))
+			p++;
+		if (p < size && std::isalpha(static_cast<unsigned char>(data[p])))
+			return;
+		const void *newline = std::memchr(data + p, '\n', size - p);
+		g_smdposition = newline ? static_cast<const char *>(newline) - data + 1 : size;
+		g_smdlinecount++;
+	}
+}
+
 static void clip_rotations(Vector3 rot)
 {
 	// clip everything to : -Q_PI <= x < Q_PI
@@ -267,6 +340,500 @@ static void make_transitions(const QC &qc)
 	}
 }
 
+// Vertices attached to one bone, split for the sequence bounding boxes
+struct BoneHull
+{
+	std::vector<Vector3> hull;	 // convex hull vertices
+	std::vector<Vector3> inside; // the other vertices, only transformed when the hull gets close to the bounds
+	Vector3 center;				 // bounding sphere of all the vertices
+	double radius = 0.0;
+	float extent = 0.0f;	// largest absolute coordinate
+	double tolerance = 0.0; // how far the inside vertices may lie outside the hull
+};
+
+// Splits the distinct vertex positions of every bone into its convex hull vertices and the rest
+static std::vector<BoneHull> find_bone_hulls(const std::vector<std::vector<Vector3>> &bonevertices)
+{
+	std::vector<BoneHull> bonehulls(bonevertices.size());
+	std::vector<int> indices;
+	for (int k = 0; k < bonevertices.size(); k++)
+	{
+		const auto &vertices = bonevertices[k];
+		BoneHull &bonehull = bonehulls[k];
+		if (vertices.empty())
+			continue;
+
+		Vector3 lo = vertices[0];
+		Vector3 hi = vertices[0];
+		for (auto &vert : vertices)
+		{
+			for (int i = 0; i < 3; i++)
+			{
+				lo[i] = std::min(lo[i], vert[i]);
+				hi[i] = std::max(hi[i], vert[i]);
+				bonehull.extent = std::max(bonehull.extent, std::fabs(vert[i]));
+			}
+		}
+		bonehull.center = (lo + hi) * 0.5f;
+		for (auto &vert : vertices)
+		{
+			const double dx = double{vert.x} - bonehull.center.x;
+			const double dy = double{vert.y} - bonehull.center.y;
+			const double dz = double{vert.z} - bonehull.center.z;
+			bonehull.radius = std::max(bonehull.radius, std::sqrt(dx * dx + dy * dy + dz * dz));
+		}
+		bonehull.radius *= 1.0 + 1e-9;
+
+		if (!convex_hull_vertices(vertices, indices, bonehull.tolerance))
+		{
+			// flat or too few vertices, all of them are hull vertices
+			bonehull.hull = vertices;
+			continue;
+		}
+		std::vector<char> on_hull(vertices.size(), 0);
+		for (int i : indices)
+		{
+			on_hull[i] = 1;
+		}
+		for (int i = 0; i < vertices.size(); i++)
+		{
+			(on_hull[i] ? bonehull.hull : bonehull.inside).push_back(vertices[i]);
+		}
+	}
+	return bonehulls;
+}
+
+// How far past value, the transformed position of one vertex, the transformed position of another vertex of the bone
+// can lie along axis i when the two are at most distance apart. vector_transform rounds to within
+// 1.5 * FLT_EPSILON * row * extent of the exact value, the last term covers rounding the translation
+static double transform_slack(const Matrix3x4 &m, int i, const BoneHull &bonehull, double distance, double value)
+{
+	const double row = std::fabs(m[i][0]) + std::fabs(m[i][1]) + std::fabs(m[i][2]);
+	const double reach = row * distance + 4.0 * FLT_EPSILON * row * bonehull.extent;
+	return reach + 2.0 * FLT_EPSILON * (std::fabs(value) + reach);
+}
+
+// Bounding box of every vertex over all frames and blends of the sequence.
+// Bones whose bounding sphere is inside the box found so far are skipped. Otherwise only the hull vertices of a
+// bone can be extreme, up to float rounding: the other vertices of the bone are only transformed in frames where
+// its hull comes within that rounding of the bounds, so the result is exactly that of transforming every vertex
+static void find_sequence_bounding_box(const std::vector<BoneHull> &bonehulls, Sequence &sequence)
+{
+	Vector3 bmin{9999.0, 9999.0, 9999.0};
+	Vector3 bmax{-9999.0, -9999.0, -9999.0};
+
+	const auto add_point = [&bmin, &bmax](const Vector3 &pos)
+	{
+		if (pos[0] < bmin[0])
+			bmin[0] = pos[0];
+		if (pos[1] < bmin[1])
+			bmin[1] = pos[1];
+		if (pos[2] < bmin[2])
+			bmin[2] = pos[2];
+		if (pos[0] > bmax[0])
+			bmax[0] = pos[0];
+		if (pos[1] > bmax[1])
+			bmax[1] = pos[1];
+		if (pos[2] > bmax[2])
+			bmax[2] = pos[2];
+	};
+
+	std::vector<std::array<Vector3, 2>> hullbounds(bonehulls.size()); // [bone] min, max of the transformed hull
+	std::vector<char> skipped(bonehulls.size());
+
+	// find intersection box volume for each bone
+	for (auto &anim : sequence.anims)
+	{
+		for (int n = 0; n < sequence.numframes; n++)
+		{
+			std::array<Matrix3x4, MAXSTUDIOBONES> bonetransform{}; // bone transformation matrix
+			Matrix3x4 bonematrix{};								   // local transformation matrix
+			int j = 0;
+			for (auto &bone : g_bonetable)
+			{
+				Vector3 angles{
+					anim.rot[j][n][0],
+					anim.rot[j][n][1],
+					anim.rot[j][n][2]};
+
+				bonematrix = angle_matrix(angles);
+
+				bonematrix[0][3] = anim.pos[j][n][0];
+				bonematrix[1][3] = anim.pos[j][n][1];
+				bonematrix[2][3] = anim.pos[j][n][2];
+
+				if (bone.parent == -1)
+				{
+					matrix_copy(bonematrix, bonetransform[j]);
+				}
+				else
+				{
+					bonetransform[j] =
+						concat_transforms(bonetransform[bone.parent], bonematrix);
+				}
+				j++;
+			}
+
+			for (int k = 0; k < bonehulls.size(); k++)
+			{
+				const BoneHull &bonehull = bonehulls[k];
+				const Matrix3x4 &m = bonetransform[k];
+				skipped[k] = 1;
+				if (bonehull.hull.empty())
+					continue;
+
+				const Vector3 center = vector_transform(bonehull.center, m);
+				bool contained = true;
+				for (int i = 0; i < 3 && contained; i++)
+				{
+					const double slack = transform_slack(m, i, bonehull, bonehull.radius, center[i]);
+					contained = center[i] - slack > bmin[i] && center[i] + slack < bmax[i];
+				}
+				if (contained)
+					continue;
+				skipped[k] = 0;
+
+				auto &bounds = hullbounds[k];
+				bounds[0] = Vector3{9999.0, 9999.0, 9999.0};
+				bounds[1] = Vector3{-9999.0, -9999.0, -9999.0};
+				for (auto &vert : bonehull.hull)
+				{
+					const Vector3 pos = vector_transform(vert, m);
+					for (int i = 0; i < 3; i++)
+					{
+						if (pos[i] < bounds[0][i])
+							bounds[0][i] = pos[i];
+						if (pos[i] > bounds[1][i])
+							bounds[1][i] = pos[i];
+					}
+				}
+				add_point(bounds[0]);
+				add_point(bounds[1]);
+			}
+
+			for (int k = 0; k < bonehulls.size(); k++)
+			{
+				const BoneHull &bonehull = bonehulls[k];
+				const Matrix3x4 &m = bonetransform[k];
+				if (skipped[k] || bonehull.inside.empty())
+					continue;
+
+				bool close = false;
+				for (int i = 0; i < 3 && !close; i++)
+				{
+					const float lo = hullbounds[k][0][i];
+					const float hi = hullbounds[k][1][i];
+					close = lo - transform_slack(m, i, bonehull, bonehull.tolerance, lo) <= bmin[i] ||
+							hi + transform_slack(m, i, bonehull, bonehull.tolerance, hi) >= bmax[i];
+				}
+				if (!close)
+					continue;
+
+				for (auto &vert : bonehull.inside)
+				{
+					add_point(vector_transform(vert, m));
+				}
+			}
+		}
+	}
+
+	sequence.bmin = bmin;
+	sequence.bmax = bmax;
+}
+
+// Run-length encodes n quantized values into data, returns the number of StudioAnimationValue entries used
+static int encode_animation_values(const short *value, int n, StudioAnimationValue *data)
+{
+	std::memset(data, 0, n * 2 * sizeof(StudioAnimationValue));
+	StudioAnimationValue *pcount = data;
+	StudioAnimationValue *pvalue = pcount + 1;
+
+	pcount->num.valid = 1;
+	pcount->num.total = 1;
+	pvalue->value = value[0];
+	pvalue++;
+
+	// this compression algorithm needs work
+
+	for (int m = 1; m < n; m++)
+	{
+		if (pcount->num.total == 255)
+		{
+			// too many, force a new entry
+			pcount = pvalue;
+			pvalue = pcount + 1;
+			pcount->num.valid++;
+			pvalue->value = value[m];
+			pvalue++;
+		}
+		// insert value if they're not equal,
+		// or if we're not on a run and the run is less than 3 units
+		else if ((value[m] != value[m - 1]) ||
+				 ((pcount->num.total == pcount->num.valid) &&
+				  ((m < n - 1) && value[m] != value[m + 1])))
+		{
+			if (pcount->num.total != pcount->num.valid)
+			{
+				pcount = pvalue;
+				pvalue = pcount + 1;
+			}
+			pcount->num.valid++;
+			pvalue->value = value[m];
+			pvalue++;
+		}
+		pcount->num.total++;
+	}
+	return static_cast<int>(pvalue - data);
+}
+
+// Replaces every stretch of values spanning at most 2 * tolerance by its midpoint, so the encoder stores it as one run.
+// Returns the largest change
+static int snap_animation_values(short *value, int n, int tolerance)
+{
+	int error = 0;
+	for (int start = 0, end; start < n; start = end)
+	{
+		int lo = value[start];
+		int hi = value[start];
+		for (end = start + 1; end < n; end++)
+		{
+			if (std::max(hi, int{value[end]}) - std::min(lo, int{value[end]}) > 2 * tolerance)
+				break;
+			lo = std::min(lo, int{value[end]});
+			hi = std::max(hi, int{value[end]});
+		}
+		const int mid = lo + (hi - lo) / 2;
+		for (int m = start; m < end; m++)
+		{
+			error = std::max(error, std::abs(value[m] - mid));
+			value[m] = static_cast<short>(mid);
+		}
+	}
+	return error;
+}
+
+// Quantizes the sequence frames against the bone scales and run-length encodes each channel.
+// With --anim-tolerance, values within the tolerance are merged into runs first
+static void compress_sequence_animations(Sequence &sequence)
+{
+	const bool lossy = g_animtolerancepos > 0.0f || g_animtolerancerot > 0.0f;
+	int changes = 0;
+	std::size_t lossless_size = 0;
+	std::size_t size = 0;
+	float pos_error = 0.0f;
+	float rot_error = 0.0f;
+
+	for (auto &anim : sequence.anims)
+	{
+		for (int j = 0; j < g_bonetable.size(); j++)
+		{
+			for (int k = 0; k < DEGREESOFFREEDOM; k++)
+			{
+				float v;
+				std::array<short, MAXSTUDIOANIMATIONS> value{};
+				std::array<StudioAnimationValue, MAXSTUDIOANIMATIONS * 2> data;
+				int n;
+				for (n = 0; n < sequence.numframes; n++)
+				{
+					switch (k)
+					{
+					case 0:
+					case 1:
+					case 2:
+						value[n] = static_cast<short>(
+							(anim.pos[j][n][k] - g_bonetable[j].pos[k]) /
+							g_bonetable[j].posscale[k]);
+						break;
+					case 3:
+					case 4:
+					case 5:
+						v = (anim.rot[j][n][k - 3] - g_bonetable[j].rot[k - 3]);
+						if (v >= Q_PI)
+							v -= Q_PI * 2;
+						if (v < -Q_PI)
+							v += Q_PI * 2;
+
+						value[n] =
+							static_cast<short>(v / g_bonetable[j].rotscale[k - 3]);
+						break;
+					}
+				}
+				if (n == 0)
+					error("no animation frames: " + sequence.name + "\n");
+
+				anim.numanim[j][k] = 0;
+
+				for (int m = 1, p = 0; m < n; m++)
+				{
+					if (abs(value[p] - value[m]) > 1600)
+					{
+						changes++;
+						p = m;
+					}
+				}
+
+				if (lossy)
+				{
+					int count = encode_animation_values(value.data(), n, data.data());
+					if (!(count == 2 && value[0] == 0))
+						lossless_size += count * sizeof(StudioAnimationValue);
+
+					// tolerance in quantized steps of this channel
+					if (k < 3)
+					{
+						const int tolerance = static_cast<int>(std::min(g_animtolerancepos / g_bonetable[j].posscale[k], 32767.0f));
+						pos_error = std::max(pos_error, snap_animation_values(value.data(), n, tolerance) * g_bonetable[j].posscale[k]);
+					}
+					else
+					{
+						const int tolerance = static_cast<int>(std::min(g_animtolerancerot / g_bonetable[j].rotscale[k - 3], 32767.0f));
+						rot_error = std::max(rot_error, snap_animation_values(value.data(), n, tolerance) * g_bonetable[j].rotscale[k - 3]);
+					}
+				}
+
+				const int count = encode_animation_values(value.data(), n, data.data());
+				anim.numanim[j][k] = count;
+				if (anim.numanim[j][k] == 2 && value[0] == 0)
+				{
+					anim.numanim[j][k] = 0;
+				}
+				else
+				{
+					anim.anims[j][k] = (StudioAnimationValue *)std::calloc(
+						count, sizeof(StudioAnimationValue));
+					std::memcpy(anim.anims[j][k], data.data(),
+								count * sizeof(StudioAnimationValue));
+					size += count * sizeof(StudioAnimationValue);
+				}
+			}
+		}
+	}
+
+	if (lossy)
+	{
+		printf("Sequence %s: animation %zu -> %zu bytes, %zu saved, max error %g units, %g degrees\n",
+			   sequence.name.c_str(), lossless_size, size, lossless_size - size, pos_error, to_degrees(rot_error));
+	}
+}
+
+// Hash of everything besides the frames that bounding boxes and compressed animations depend on
+static std::uint64_t sequence_inputs_hash(const QC &qc)
+{
+	std::uint64_t hash = 0;
+	for (auto &bone : g_bonetable)
+	{
+		hash = hash_bytes(&bone.parent, sizeof(bone.parent), hash);
+		hash = hash_bytes(&bone.pos, sizeof(bone.pos), hash);
+		hash = hash_bytes(&bone.posscale, sizeof(bone.posscale), hash);
+		hash = hash_bytes(&bone.rot, sizeof(bone.rot), hash);
+		hash = hash_bytes(&bone.rotscale, sizeof(bone.rotscale), hash);
+	}
+	for (auto &submodel : qc.submodels)
+	{
+		hash = hash_bytes(submodel->verts.data(), submodel->verts.size() * sizeof(Vertex), hash);
+	}
+	hash = hash_bytes(&g_animtolerancepos, sizeof(g_animtolerancepos), hash);
+	hash = hash_bytes(&g_animtolerancerot, sizeof(g_animtolerancerot), hash);
+	return hash;
+}
+
+// Hash of the relinked frames of every blend, seeded with sequence_inputs_hash
+static std::uint64_t sequence_frames_hash(const Sequence &sequence, std::uint64_t hash)
+{
+	const std::size_t size = sequence.numframes * sizeof(Vector3);
+	hash = hash_bytes(&sequence.numframes, sizeof(sequence.numframes), hash);
+	for (auto &anim : sequence.anims)
+	{
+		for (int j = 0; j < g_bonetable.size(); j++)
+		{
+			hash = hash_bytes(anim.pos[j], size, hash);
+			hash = hash_bytes(anim.rot[j], size, hash);
+		}
+	}
+	return hash;
+}
+
+static void load_cached_sequence(const CachedSequence &cached, Sequence &sequence)
+{
+	sequence.bmin = cached.bmin;
+	sequence.bmax = cached.bmax;
+	auto values = cached.anims.begin();
+	for (auto &anim : sequence.anims)
+	{
+		for (int j = 0; j < g_bonetable.size(); j++)
+		{
+			for (int k = 0; k < DEGREESOFFREEDOM; k++, values++)
+			{
+				anim.numanim[j][k] = static_cast<int>(values->size());
+				if (values->empty())
+					continue;
+				anim.anims[j][k] = (StudioAnimationValue *)std::calloc(values->size(), sizeof(StudioAnimationValue));
+				std::memcpy(anim.anims[j][k], values->data(), values->size() * sizeof(StudioAnimationValue));
+			}
+		}
+	}
+}
+
+static void store_cached_sequence(const Sequence &sequence, CachedSequence &cached)
+{
+	cached.bmin = sequence.bmin;
+	cached.bmax = sequence.bmax;
+	cached.anims.clear();
+	for (auto &anim : sequence.anims)
+	{
+		for (int j = 0; j < g_bonetable.size(); j++)
+		{
+			for (int k = 0; k < DEGREESOFFREEDOM; k++)
+			{
+				if (anim.numanim[j][k])
+					cached.anims.emplace_back(anim.anims[j][k], anim.anims[j][k] + anim.numanim[j][k]);
+				else
+					cached.anims.emplace_back();
+			}
+		}
+	}
+}
+
+// Difference of one degree of freedom of a frame from the bone's default, rotations wrapped to -Q_PI..Q_PI
+template <int DOF>
+static float bone_dof_delta(const BoneTable &bone, const Vector3 &pos, const Vector3 &rot)
+{
+	if constexpr (DOF < 3)
+	{
+		return pos[DOF] - bone.pos[DOF];
+	}
+	else
+	{
+		float v = rot[DOF - 3] - bone.rot[DOF - 3];
+		if (v >= Q_PI)
+			v -= Q_PI * 2;
+		if (v < -Q_PI)
+			v += Q_PI * 2;
+		return v;
+	}
+}
+
+// Widens the range of every degree of freedom of the bone to the frames of one animation
+template <int... DOF>
+static void find_bone_ranges(const BoneTable &bone, const Vector3 *pos, const Vector3 *rot, int numframes,
+							 std::array<float, DEGREESOFFREEDOM> &minv, std::array<float, DEGREESOFFREEDOM> &maxv,
+							 std::integer_sequence<int, DOF...>)
+{
+	for (int n = 0; n < numframes; n++)
+	{
+		(
+			[&]
+			{
+				const float v = bone_dof_delta<DOF>(bone, pos[n], rot[n]);
+				if (v < minv[DOF])
+					minv[DOF] = v;
+				if (v > maxv[DOF])
+					maxv[DOF] = v;
+			}(),
+			...);
+	}
+}
+
 static void simplify_model(QC &qc)
 {
 	std::array<Vector3 *, MAXSTUDIOSRCBONES> defaultpos{};
@@ -277,16 +844,38 @@ static void simplify_model(QC &qc)
 	extract_motion(qc);
 	make_transitions(qc);
 
+	// every vertex is visited once before and once after the bones are relinked: the first sweep marks the used
+	// bones and grows the per node boxes for the generated hitboxes, the second relinks the vertex and files
+	// its position under its bone for the sequence bounding boxes
+	const bool generate_hitboxes = qc.hitboxes.empty();
+	std::vector<std::vector<std::array<Vector3, 2>>> nodebounds(qc.submodels.size()); // [submodel][node] min, max
+
 	// find used bones TODO: find_used_bones()
-	for (auto &submodel : qc.submodels)
+	for (int i = 0; i < qc.submodels.size(); i++)
 	{
+		auto &submodel = qc.submodels[i];
 		for (int k = 0; k < MAXSTUDIOSRCBONES; k++)
 		{
 			submodel->boneref[k] = g_flagkeepallbones;
 		}
+		if (generate_hitboxes)
+		{
+			nodebounds[i].assign(submodel->nodes.size(), {});
+		}
 		for (auto &vert : submodel->verts)
 		{
 			submodel->boneref[vert.bone_id] = 1;
+			if (generate_hitboxes)
+			{
+				auto &bounds = nodebounds[i][vert.bone_id];
+				for (int j = 0; j < 3; j++)
+				{
+					if (vert.pos[j] < bounds[0][j])
+						bounds[0][j] = vert.pos[j];
+					if (vert.pos[j] > bounds[1][j])
+						bounds[1][j] = vert.pos[j];
+				}
+			}
 		}
 		for (int k = 0; k < MAXSTUDIOSRCBONES; k++)
 		{
@@ -348,6 +937,8 @@ static void simplify_model(QC &qc)
 						(Vector3 *)std::calloc(MAXSTUDIOANIMATIONS, sizeof(Vector3));
 					defaultrot[k] =
 						(Vector3 *)std::calloc(MAXSTUDIOANIMATIONS, sizeof(Vector3));
+					g_defaultanimations.push_back(defaultpos[k]);
+					g_defaultanimations.push_back(defaultrot[k]);
 					for (int n = 0; n < MAXSTUDIOANIMATIONS; n++)
 					{
 						defaultpos[k][n] = submodel->skeleton[j].pos;
@@ -487,11 +1078,13 @@ static void simplify_model(QC &qc)
 	}
 
 	// relink model TODO: relink_model()
+	std::vector<std::vector<Vector3>> bonevertices(g_bonetable.size());
 	for (auto &submodel : qc.submodels)
 	{
 		for (auto &vert : submodel->verts)
 		{
 			vert.bone_id = submodel->bonemap[vert.bone_id];
+			bonevertices[vert.bone_id].push_back(vert.pos);
 		}
 
 		for (auto &normal : submodel->normals)
@@ -533,7 +1126,7 @@ static void simplify_model(QC &qc)
 	}
 
 	// TODO: find_or_create_hitboxes()
-	if (qc.hitboxes.empty())
+	if (generate_hitboxes)
 	{
 		// find intersection box volume for each bone
 		for (auto &bone : g_bonetable)
@@ -544,27 +1137,22 @@ static void simplify_model(QC &qc)
 				bone.bmax[j] = 0.0;
 			}
 		}
-		// try all the connect vertices
-		for (auto &submodel : qc.submodels)
+		// try all the connect vertices, already gathered per node by the first vertex sweep
+		for (int i = 0; i < qc.submodels.size(); i++)
 		{
-			Vector3 p{};
-			for (auto &vert : submodel->verts)
+			for (int n = 0; n < nodebounds[i].size(); n++)
 			{
-				p = vert.pos;
-				int k = vert.bone_id;
-
-				if (p[0] < g_bonetable[k].bmin[0])
-					g_bonetable[k].bmin[0] = p[0];
-				if (p[1] < g_bonetable[k].bmin[1])
-					g_bonetable[k].bmin[1] = p[1];
-				if (p[2] < g_bonetable[k].bmin[2])
-					g_bonetable[k].bmin[2] = p[2];
-				if (p[0] > g_bonetable[k].bmax[0])
-					g_bonetable[k].bmax[0] = p[0];
-				if (p[1] > g_bonetable[k].bmax[1])
-					g_bonetable[k].bmax[1] = p[1];
-				if (p[2] > g_bonetable[k].bmax[2])
-					g_bonetable[k].bmax[2] = p[2];
+				if (!qc.submodels[i]->boneref[n])
+					continue;
+				const auto &bounds = nodebounds[i][n];
+				BoneTable &bone = g_bonetable[qc.submodels[i]->bonemap[n]];
+				for (int j = 0; j < 3; j++)
+				{
+					if (bounds[0][j] < bone.bmin[j])
+						bone.bmin[j] = bounds[0][j];
+					if (bounds[1][j] > bone.bmax[j])
+						bone.bmax[j] = bounds[1][j];
+				}
 			}
 		}
 		// add in all your children as well
@@ -658,54 +1246,44 @@ static void simplify_model(QC &qc)
 	}
 
 	// find scales for all bones TODO: find_bone_scales()
+	// one pass over the frames of every animation widens the ranges of all six degrees of freedom of a bone
+	std::vector<std::array<float, DEGREESOFFREEDOM>> bonemin(g_bonetable.size());
+	std::vector<std::array<float, DEGREESOFFREEDOM>> bonemax(g_bonetable.size());
 	for (int j = 0; j < g_bonetable.size(); j++)
 	{
 		for (int k = 0; k < DEGREESOFFREEDOM; k++)
 		{
-			float minv, maxv, scale;
-
 			if (k < 3)
 			{
-				minv = -128.0;
-				maxv = 128.0;
+				bonemin[j][k] = -128.0;
+				bonemax[j][k] = 128.0;
 			}
 			else
 			{
-				minv = -Q_PI / 8.0;
-				maxv = Q_PI / 8.0;
+				bonemin[j][k] = -Q_PI / 8.0;
+				bonemax[j][k] = Q_PI / 8.0;
 			}
-
-			for (auto &sequence : qc.sequences)
+		}
+	}
+	for (auto &sequence : qc.sequences)
+	{
+		for (auto &anim : sequence.anims)
+		{
+			for (int j = 0; j < g_bonetable.size(); j++)
 			{
-				for (auto &anim : sequence.anims)
-				{
-					for (int n = 0; n < sequence.numframes; n++)
-					{
-						float v;
-						switch (k)
-						{
-						case 0:
-						case 1:
-						case 2:
-							v = (anim.pos[j][n][k] - g_bonetable[j].pos[k]);
-							break;
-						case 3:
-						case 4:
-						case 5:
-							v = (anim.rot[j][n][k - 3] - g_bonetable[j].rot[k - 3]);
-							if (v >= Q_PI)
-								v -= Q_PI * 2;
-							if (v < -Q_PI)
-								v += Q_PI * 2;
-							break;
-						}
-						if (v < minv)
-							minv = v;
-						if (v > maxv)
-							maxv = v;
-					}
-				}
+				find_bone_ranges(g_bonetable[j], anim.pos[j], anim.rot[j], sequence.numframes, bonemin[j], bonemax[j],
+								 std::make_integer_sequence<int, DEGREESOFFREEDOM>{});
 			}
+		}
+	}
+	for (int j = 0; j < g_bonetable.size(); j++)
+	{
+		for (int k = 0; k < DEGREESOFFREEDOM; k++)
+		{
+			const float minv = bonemin[j][k];
+			const float maxv = bonemax[j][k];
+			float scale;
+
 			if (minv < maxv)
 			{
 				if (-minv > maxv)
@@ -737,184 +1315,78 @@ static void simplify_model(QC &qc)
 		}
 	}
 
-	// find bounding box for each sequence TODO: find_sequence_bounding_boxes()
-	for (auto &sequence : qc.sequences)
+	// vertices shared by several submodels (or repeated in one) only have to be transformed once per frame
+	for (auto &vertices : bonevertices)
 	{
-		Vector3 bmin{9999.0, 9999.0, 9999.0};
-		Vector3 bmax{-9999.0, -9999.0, -9999.0};
+		const auto less = [](const Vector3 &a, const Vector3 &b)
+		{ return std::tie(a.x, a.y, a.z) < std::tie(b.x, b.y, b.z); };
+		const auto equal = [](const Vector3 &a, const Vector3 &b)
+		{ return a.x == b.x && a.y == b.y && a.z == b.z; };
+		std::sort(vertices.begin(), vertices.end(), less);
+		vertices.erase(std::unique(vertices.begin(), vertices.end(), equal), vertices.end());
+	}
 
-		// find intersection box volume for each bone
-		for (auto &anim : sequence.anims)
+	// find bounding boxes and compress animations, reusing the results of unchanged sequences
+	const std::uint64_t model_hash = g_compilecache ? sequence_inputs_hash(qc) : 0;
+	std::vector<std::string> recomputed;
+	std::vector<BoneHull> bonehulls; // found for the first recomputed sequence
+	for (auto &sequence : qc.sequences)
+	{
+		CachedSequence *cached = nullptr;
+		std::uint64_t hash = 0;
+		if (g_compilecache)
 		{
-			for (int n = 0; n < sequence.numframes; n++)
+			hash = sequence_frames_hash(sequence, model_hash);
+			cached = &g_compilecache->sequences[g_compileqcpath + '|' + sequence.name];
+			if (cached->hash == hash)
 			{
-				std::array<Matrix3x4, MAXSTUDIOBONES> bonetransform{}; // bone transformation matrix
-				Matrix3x4 bonematrix{};								   // local transformation matrix
-				Vector3 pos{};
-				int j = 0;
-				for (auto &bone : g_bonetable)
-				{
-					Vector3 angles{
-						anim.rot[j][n][0],
-						anim.rot[j][n][1],
-						anim.rot[j][n][2]};
-
-					bonematrix = angle_matrix(angles);
-
-					bonematrix[0][3] = anim.pos[j][n][0];
-					bonematrix[1][3] = anim.pos[j][n][1];
-					bonematrix[2][3] = anim.pos[j][n][2];
-
-					if (bone.parent == -1)
-					{
-						matrix_copy(bonematrix, bonetransform[j]);
-					}
-					else
-					{
-						bonetransform[j] =
-							concat_transforms(bonetransform[bone.parent], bonematrix);
-					}
-					j++;
-				}
-
-				for (auto &submodel : qc.submodels)
-				{
-					for (auto &vert : submodel->verts)
-					{
-						pos = vector_transform(vert.pos, bonetransform[vert.bone_id]);
-
-						if (pos[0] < bmin[0])
-							bmin[0] = pos[0];
-						if (pos[1] < bmin[1])
-							bmin[1] = pos[1];
-						if (pos[2] < bmin[2])
-							bmin[2] = pos[2];
-						if (pos[0] > bmax[0])
-							bmax[0] = pos[0];
-						if (pos[1] > bmax[1])
-							bmax[1] = pos[1];
-						if (pos[2] > bmax[2])
-							bmax[2] = pos[2];
-					}
-				}
+				g_compilecache->sequence_hits++;
+				load_cached_sequence(*cached, sequence);
+				continue;
 			}
 		}
 
-		sequence.bmin = bmin;
-		sequence.bmax = bmax;
+		if (bonehulls.empty())
+		{
+			bonehulls = find_bone_hulls(bonevertices);
+		}
+		find_sequence_bounding_box(bonehulls, sequence);
+		compress_sequence_animations(sequence);
+
+		if (cached)
+		{
+			g_compilecache->sequence_misses++;
+			cached->hash = hash;
+			store_cached_sequence(sequence, *cached);
+			recomputed.push_back(sequence.name);
+		}
 	}
 
-	// reduce animations TODO: reduce_animations()
+	// sequences removed from the QC
+	if (g_compilecache)
 	{
-		int changes = 0;
-
-		for (auto &sequence : qc.sequences)
+		const std::string prefix = g_compileqcpath + '|';
+		for (auto it = g_compilecache->sequences.begin(); it != g_compilecache->sequences.end();)
 		{
-			for (auto &anim : sequence.anims)
-			{
-				for (int j = 0; j < g_bonetable.size(); j++)
-				{
-					for (int k = 0; k < DEGREESOFFREEDOM; k++)
-					{
-						float v;
-						std::array<short, MAXSTUDIOANIMATIONS> value{};
-						std::array<StudioAnimationValue, MAXSTUDIOANIMATIONS> data{};
-						int n;
-						for (n = 0; n < sequence.numframes; n++)
-						{
-							switch (k)
-							{
-							case 0:
-							case 1:
-							case 2:
-								value[n] = static_cast<short>(
-									(anim.pos[j][n][k] - g_bonetable[j].pos[k]) /
-									g_bonetable[j].posscale[k]);
-								break;
-							case 3:
-							case 4:
-							case 5:
-								v = (anim.rot[j][n][k - 3] - g_bonetable[j].rot[k - 3]);
-								if (v >= Q_PI)
-									v -= Q_PI * 2;
-								if (v < -Q_PI)
-									v += Q_PI * 2;
-
-								value[n] =
-									static_cast<short>(v / g_bonetable[j].rotscale[k - 3]);
-								break;
-							}
-						}
-						if (n == 0)
-							error("no animation frames: " + sequence.name + "\n");
-
-						anim.numanim[j][k] = 0;
-
-						std::memset(data.data(), 0, sizeof(data));
-						StudioAnimationValue *pcount = data.data();
-						StudioAnimationValue *pvalue = pcount + 1;
-
-						pcount->num.valid = 1;
-						pcount->num.total = 1;
-						pvalue->value = value[0];
-						pvalue++;
-
-						for (int m = 1, p = 0; m < n; m++)
-						{
-							if (abs(value[p] - value[m]) > 1600)
-							{
-								changes++;
-								p = m;
-							}
-						}
-
-						// this compression algorithm needs work
-
-						for (int m = 1; m < n; m++)
-						{
-							if (pcount->num.total == 255)
-							{
-								// too many, force a new entry
-								pcount = pvalue;
-								pvalue = pcount + 1;
-								pcount->num.valid++;
-								pvalue->value = value[m];
-								pvalue++;
-							}
-							// insert value if they're not equal,
-							// or if we're not on a run and the run is less than 3 units
-							else if ((value[m] != value[m - 1]) ||
-									 ((pcount->num.total == pcount->num.valid) &&
-									  ((m < n - 1) && value[m] != value[m + 1])))
-							{
-								if (pcount->num.total != pcount->num.valid)
-								{
-									pcount = pvalue;
-									pvalue = pcount + 1;
-								}
-								pcount->num.valid++;
-								pvalue->value = value[m];
-								pvalue++;
-							}
-							pcount->num.total++;
-						}
+			const bool current = it->first.compare(0, prefix.size(), prefix) != 0 ||
+								 std::any_of(qc.sequences.begin(), qc.sequences.end(), [&](const Sequence &sequence)
+											 { return it->first.compare(prefix.size(), std::string::npos, sequence.name) == 0; });
+			it = current ? std::next(it) : g_compilecache->sequences.erase(it);
+		}
+	}
 
-						anim.numanim[j][k] = static_cast<int>(pvalue - data.data());
-						if (anim.numanim[j][k] == 2 && value[0] == 0)
-						{
-							anim.numanim[j][k] = 0;
-						}
-						else
-						{
-							anim.anims[j][k] = (StudioAnimationValue *)std::calloc(
-								pvalue - data.data(), sizeof(StudioAnimationValue));
-							std::memcpy(anim.anims[j][k], data.data(),
-										(pvalue - data.data()) * sizeof(StudioAnimationValue));
-						}
-					}
-				}
-			}
+	if (g_compilecache && recomputed.size() == qc.sequences.size())
+	{
+		printf("Recomputed all %zu sequences\n", recomputed.size());
+	}
+	else if (g_compilecache)
+	{
+		printf("Recomputed %zu of %zu sequences", recomputed.size(), qc.sequences.size());
+		for (std::size_t i = 0; i < recomputed.size(); i++)
+		{
+			printf("%s %s", i ? "," : ":", recomputed[i].c_str());
 		}
+		printf("\n");
 	}
 }
 
@@ -1157,18 +1629,149 @@ static void reset_texture_coord_ranges(Mesh *pmesh, const Texture *ptexture)
 	}
 }
 
-static void grab_bmp(const char *filename, Texture *ptexture)
+// A texture file mapped on the compiling thread, for grab_bmp to read on a worker thread.
+// The image points into the file (or the cached pixels) until resize_texture copies it to the skin
+struct SkinFile
+{
+	std::filesystem::path path;
+	MappedFile file;
+	CachedTexture *cached = nullptr; // nullptr without a compile cache
+	bool hit = false;
+	BmpImage image;
+	bool truecolor = false;			  // 24/32-bit BMP or TGA, quantized to a palette
+	bool masked = false;			  // STUDIO_NF_MASKED, the quantizer keeps index 255 for the transparent pixels
+	MappedFile quantized;			  // previously quantized image from the texture cache directory
+	std::vector<std::uint8_t> pixels; // newly quantized pixels
+};
+
+// Hash of the texture file, and of the quantizer options if it has to be quantized
+static std::uint64_t skin_hash(const SkinFile &file)
+{
+	std::uint64_t hash = hash_bytes(file.file.data(), file.file.size());
+	if (file.truecolor)
+	{
+		hash = hash_bytes(&QUANTIZE_VERSION, sizeof(QUANTIZE_VERSION), hash);
+		hash = hash_bytes(&g_flagdithertextures, sizeof(g_flagdithertextures), hash);
+		hash = hash_bytes(&file.masked, sizeof(file.masked), hash);
+	}
+	return hash;
+}
+
+static std::filesystem::path quantized_texture_path(std::uint64_t hash)
+{
+	char name[32];
+	std::snprintf(name, sizeof(name), "%016llx.bmp", static_cast<unsigned long long>(hash));
+	return g_texturecachedir / name;
+}
+
+// Writes under a temporary name, then renames, failures are ignored. Returns the size of the file written, 0 if it failed
+static std::size_t save_quantized_texture(const std::filesystem::path &path, const BmpImage &image)
+{
+	const std::vector<std::byte> bmp = write_bmp(image);
+	std::error_code ec;
+	std::filesystem::create_directories(path.parent_path(), ec);
+	const std::filesystem::path temp = temporary_path(path);
+	std::ofstream out(temp, std::ios::binary);
+	if (!out.write(reinterpret_cast<const char *>(bmp.data()), bmp.size()))
+	{
+		out.close();
+		std::filesystem::remove(temp, ec);
+		return 0;
+	}
+	out.close();
+	std::filesystem::rename(temp, path, ec);
+	if (ec)
+	{
+		std::filesystem::remove(temp, ec);
+		return 0;
+	}
+	return bmp.size();
+}
+
+// Reduces a 24/32-bit BMP or TGA to 8 bits, or reads the result of a previous compile from the texture cache
+static void quantize_skin(SkinFile &file, std::uint64_t hash)
+{
+	std::filesystem::path cache_path;
+	if (!g_texturecachedir.empty())
+	{
+		cache_path = quantized_texture_path(hash);
+		if (file.quantized.open(cache_path) && read_bmp(file.quantized.data(), file.quantized.size(), &file.image) == 0)
+		{
+			// touched so eviction sees it as recently used
+			std::error_code ec;
+			std::filesystem::last_write_time(cache_path, std::filesystem::file_time_type::clock::now(), ec);
+			return;
+		}
+	}
+
+	const bool tga = case_insensitive_compare(file.path.extension().string(), ".tga");
+	TrueColorImage truecolor;
+	if (int result = tga ? read_tga(file.file.data(), file.file.size(), &truecolor)
+						 : read_bmp_truecolor(file.file.data(), file.file.size(), &truecolor))
+	{
+		error("error " + std::to_string(result) + " reading " + (tga ? "TGA" : "BMP") + " image \"" +
+			  file.path.string() + "\"\n");
+	}
+	quantize_image(truecolor, g_flagdithertextures, file.masked, file.pixels, file.image.palette);
+	file.image.width = truecolor.width;
+	file.image.height = truecolor.height;
+	file.image.stride = (truecolor.width + 3) & ~3;
+	file.image.bits = file.pixels.data();
+
+	if (!cache_path.empty())
+		g_cachebyteswritten += save_quantized_texture(cache_path, file.image);
+}
+
+static void grab_bmp(SkinFile &file, Texture *ptexture)
 {
-	if (int result = load_bmp(filename, &ptexture->ppicture,
-							  (std::uint8_t **)&ptexture->ppal,
-							  &ptexture->srcwidth, &ptexture->srcheight))
+	std::uint64_t hash = 0;
+	CachedTexture *cached = file.cached;
+
+	file.truecolor = case_insensitive_compare(file.path.extension().string(), ".tga") ||
+					 bmp_bit_count(file.file.data(), file.file.size()) > 8;
+	file.masked = ptexture->flags & STUDIO_NF_MASKED;
+	if (cached || file.truecolor)
+		hash = skin_hash(file);
+
+	if (cached)
+	{
+		if (cached->hash == hash && !cached->pixels.empty())
+		{
+			file.hit = true;
+			file.image.width = ptexture->srcwidth = cached->width;
+			file.image.height = ptexture->srcheight = cached->height;
+			file.image.stride = (cached->width + 3) & ~3;
+			file.image.bits = cached->pixels.data();
+			std::memcpy(file.image.palette, cached->palette.data(), sizeof(file.image.palette));
+			return;
+		}
+	}
+
+	if (file.truecolor)
+	{
+		quantize_skin(file, hash);
+	}
+	else if (int result = read_bmp(file.file.data(), file.file.size(), &file.image))
 	{
 		error("error " + std::to_string(result) + " reading BMP image \"" +
-			  filename + "\"\n");
+			  file.path.string() + "\"\n");
+	}
+	ptexture->srcwidth = file.image.width;
+	ptexture->srcheight = file.image.height;
+
+	if (cached)
+	{
+		const BmpImage &image = file.image;
+		cached->hash = hash;
+		cached->width = image.width;
+		cached->height = image.height;
+		cached->pixels.assign(image.bits, image.bits + image.stride * image.height);
+		cached->palette.assign(image.palette, image.palette + sizeof(image.palette));
 	}
 }
 
-static void resize_texture(const QC &qc, Texture *ptexture)
+// Sets the skin rectangle and size, done for every texture before they are resized in parallel
+static void size_texture(Texture *ptexture)
 {
 	// Keep the original texture without resizing to avoid uv shift
 	ptexture->skintop = static_cast<int>(ptexture->min_t);
@@ -1191,28 +1794,30 @@ static void resize_texture(const QC &qc, Texture *ptexture)
 			   ptexture->min_t, ptexture->max_t);
 		error("Texture too large\n");
 	}
+}
+
+static void resize_texture(const QC &qc, Texture *ptexture, const BmpImage &image)
+{
 	std::uint8_t *pdest = (std::uint8_t *)malloc(ptexture->size);
 	ptexture->pdata = pdest;
 
-	// Data is saved as a multiple of 4
-	const int srcadjustedwidth = (ptexture->srcwidth + 3) & ~3;
+	const auto wrap = [](int value, int size)
+	{ return (value % size + size) % size; };
 
-	// Move the picture data to the model area, replicating missing data, deleting
-	// unused data.
-	for (int i = 0, t = ptexture->srcheight - ptexture->skinheight -
-						ptexture->skintop + 10 * ptexture->srcheight;
-		 i < ptexture->skinheight; i++, t++)
+	// Move the picture data to the model area top row first, replicating missing data, deleting
+	// unused data. Rows are copied in runs up to the right edge of the picture, where they wrap
+	const int top = wrap(ptexture->srcheight - ptexture->skinheight - ptexture->skintop, ptexture->srcheight);
+	const int left = wrap(ptexture->skinleft, ptexture->srcwidth);
+	for (int i = 0; i < ptexture->skinheight; i++)
 	{
-		while (t >= ptexture->srcheight)
-			t -= ptexture->srcheight;
-		while (t < 0)
-			t += ptexture->srcheight;
-		for (int j = 0, s = ptexture->skinleft + 10 * ptexture->srcwidth;
-			 j < ptexture->skinwidth; j++, s++)
+		const int t = (top + i) % ptexture->srcheight;
+		const std::uint8_t *row = image.bits + (ptexture->srcheight - 1 - t) * image.stride;
+		for (int j = 0, s = left; j < ptexture->skinwidth; s = 0)
 		{
-			while (s >= ptexture->srcwidth)
-				s -= ptexture->srcwidth;
-			*(pdest++) = *(ptexture->ppicture + s + t * srcadjustedwidth);
+			const int count = std::min(ptexture->skinwidth - j, ptexture->srcwidth - s);
+			std::memcpy(pdest, row + s, count);
+			pdest += count;
+			j += count;
 		}
 	}
 
@@ -1222,7 +1827,7 @@ static void resize_texture(const QC &qc, Texture *ptexture)
 	if (qc.gamma != 1.8f)
 	// gamma correct the monster textures to a gamma of 1.8
 	{
-		const std::uint8_t *psrc = (std::uint8_t *)ptexture->ppal;
+		const std::uint8_t *psrc = image.palette;
 		const float g = qc.gamma / 1.8f;
 		for (int i = 0; i < 768; i++)
 		{
@@ -1232,40 +1837,146 @@ static void resize_texture(const QC &qc, Texture *ptexture)
 	}
 	else
 	{
-		memcpy(pdest, ptexture->ppal, 256 * sizeof(RGB));
+		memcpy(pdest, image.palette, 256 * sizeof(RGB));
 	}
-
-	free(ptexture->ppicture);
-	free(ptexture->ppal);
 }
 
-static void grab_skin(const QC &qc, Texture *ptexture)
+static void load_skin(const QC &qc, const Texture &texture, SkinFile &file)
 {
-	std::filesystem::path texture_path{(qc.cdtexture / ptexture->name).lexically_normal()};
-	if (!std::filesystem::exists(texture_path))
+	file.path = (qc.cdtexture / texture.name).lexically_normal();
+	if (!g_fileprovider->exists(file.path))
 	{
-		error("Cannot find \"" + ptexture->name + "\" texture in \"" +
+		error("Cannot find \"" + texture.name + "\" texture in \"" +
 			  qc.cdtexture.string() + "\" or path does not exist\n");
 	}
-	if (case_insensitive_compare(texture_path.extension().string(), ".bmp"))
+	if (!case_insensitive_compare(file.path.extension().string(), ".bmp") &&
+		!case_insensitive_compare(file.path.extension().string(), ".tga"))
 	{
-		grab_bmp(texture_path.string().c_str(), ptexture);
+		error("Not supported texture format: \"" + file.path.string() +
+			  "\"\n");
 	}
-	else
+	g_fileprovider->map(file.path, file.file);
+	if (g_compilecache)
+		file.cached = &g_compilecache->textures[file.path.generic_string()];
+}
+
+// The file provider, dependency recorder and caches are not thread safe, so the files are mapped here
+// and only reading them runs on the worker threads
+static std::vector<SkinFile> grab_skins(const QC &qc)
+{
+	std::vector<SkinFile> files(g_textures.size());
+	std::unordered_set<const CachedTexture *> cached;
+	for (int i = 0; i < g_textures.size(); i++)
 	{
-		error("Not supported texture format: \"" + texture_path.string() +
-			  "\"\n");
+		load_skin(qc, g_textures[i], files[i]);
+		// textures sharing a file decode it separately, only the first one updates the cache entry
+		if (files[i].cached && !cached.insert(files[i].cached).second)
+			files[i].cached = nullptr;
 	}
+
+	parallel_for(static_cast<int>(files.size()), [&files](int i)
+				 { grab_bmp(files[i], &g_textures[i]); });
+
+	for (const auto &file : files)
+	{
+		if (file.cached)
+			(file.hit ? g_compilecache->texture_hits : g_compilecache->texture_misses)++;
+	}
+	return files;
+}
+
+// Downscales the source images to fit --max-texture-dim and --texture-budget. The texture coordinates of the meshes are
+// converted to pixels of the new size afterwards, so they follow. Chrome textures keep their size
+static void shrink_textures(std::vector<SkinFile> &files)
+{
+	if (!g_maxtexturedim && !g_texturebudget)
+		return;
+
+	const int count = static_cast<int>(g_textures.size());
+	std::vector<int> widths(count);
+	std::vector<int> heights(count);
+	int before = 0;
+	for (int i = 0; i < count; i++)
+	{
+		int &width = widths[i] = g_textures[i].srcwidth;
+		int &height = heights[i] = g_textures[i].srcheight;
+		before += width * height;
+		if (g_maxtexturedim && !(g_textures[i].flags & STUDIO_NF_CHROME) && std::max(width, height) > g_maxtexturedim)
+		{
+			const int longest = std::max(width, height);
+			width = std::max(1, width * g_maxtexturedim / longest);
+			height = std::max(1, height * g_maxtexturedim / longest);
+		}
+	}
+
+	// scale every texture by the same percentage until the total fits
+	const std::vector<int> maxwidths = widths;
+	const std::vector<int> maxheights = heights;
+	for (int percent = 99; g_texturebudget; percent--)
+	{
+		int total = 0;
+		for (int i = 0; i < count; i++)
+			total += widths[i] * heights[i];
+		if (total <= g_texturebudget || percent == 0)
+			break;
+		for (int i = 0; i < count; i++)
+		{
+			if (g_textures[i].flags & STUDIO_NF_CHROME)
+				continue;
+			widths[i] = std::max(1, maxwidths[i] * percent / 100);
+			heights[i] = std::max(1, maxheights[i] * percent / 100);
+		}
+	}
+
+	int after = 0;
+	for (int i = 0; i < count; i++)
+	{
+		const Texture &texture = g_textures[i];
+		if (widths[i] != texture.srcwidth || heights[i] != texture.srcheight)
+		{
+			printf("\t %s [%d %d] -> [%d %d]\n", texture.name.c_str(), texture.srcwidth, texture.srcheight,
+				   widths[i], heights[i]);
+		}
+		after += widths[i] * heights[i];
+	}
+	printf("texels    %d -> %d bytes\n", before, after);
+	if (g_texturebudget && after > g_texturebudget)
+		printf("WARNING: textures don't fit in the texture budget of %d bytes\n", g_texturebudget);
+
+	const auto shrink = [&files, &widths, &heights](int i)
+	{
+		Texture &texture = g_textures[i];
+		BmpImage &image = files[i].image;
+		if (widths[i] == texture.srcwidth && heights[i] == texture.srcheight)
+			return;
+		std::vector<std::uint8_t> pixels;
+		downscale_image(image.bits, image.stride, image.width, image.height, image.palette,
+						texture.flags & STUDIO_NF_MASKED, widths[i], heights[i], pixels);
+		files[i].pixels = std::move(pixels);
+		image.bits = files[i].pixels.data();
+		image.width = texture.srcwidth = widths[i];
+		image.height = texture.srcheight = heights[i];
+		image.stride = (image.width + 3) & ~3;
+	};
+	parallel_for(count, shrink);
+}
+
+static void resize_textures(const QC &qc, const std::vector<SkinFile> &files)
+{
+	for (auto &texture : g_textures)
+		size_texture(&texture);
+	parallel_for(static_cast<int>(g_textures.size()), [&qc, &files](int i)
+				 { resize_texture(qc, &g_textures[i], files[i].image); });
 }
 
 static void set_skin_values(const QC &qc)
 {
 
 	printf("\nGrabbing texture:\n");
+	std::vector<SkinFile> files = grab_skins(qc);
+	shrink_textures(files);
 	for (auto &texture : g_textures)
 	{
-		grab_skin(qc, &texture);
-
 		texture.max_s = -9999999;
 		texture.min_s = 9999999;
 		texture.max_t = -9999999;
@@ -1301,9 +2012,8 @@ static void set_skin_values(const QC &qc)
 				texture.min_t = g_textures[texture.parent].min_t;
 			}
 		}
-
-		resize_texture(qc, &texture);
 	}
+	resize_textures(qc, files);
 
 	for (auto *submodel : qc.submodels)
 	{
@@ -1341,6 +2051,134 @@ static void set_skin_values(const QC &qc)
 	}
 }
 
+// Textures the engine recognizes by name (player color remapping), never merged with others
+static bool is_named_texture(const Texture &texture)
+{
+	return case_insensitive_n_compare(texture.name, "DM_Base", 7) || case_insensitive_n_compare(texture.name, "Remap", 5);
+}
+
+// For every texture, the index of the first texture with the same size, flags, pixels and palette
+static std::vector<int> find_duplicate_textures()
+{
+	std::vector<int> duplicates(g_textures.size());
+	std::unordered_map<std::uint64_t, std::vector<int>> texturesbyhash;
+	for (int i = 0; i < g_textures.size(); i++)
+	{
+		const Texture &texture = g_textures[i];
+		duplicates[i] = i;
+		if (is_named_texture(texture))
+			continue;
+
+		std::uint64_t hash = hash_bytes(texture.pdata, texture.size);
+		hash = hash_bytes(&texture.flags, sizeof(texture.flags), hash);
+		hash = hash_bytes(&texture.skinwidth, sizeof(texture.skinwidth), hash);
+		hash = hash_bytes(&texture.skinheight, sizeof(texture.skinheight), hash);
+		auto &candidates = texturesbyhash[hash];
+		for (int j : candidates)
+		{
+			const Texture &other = g_textures[j];
+			if (other.flags == texture.flags && other.skinwidth == texture.skinwidth && other.skinheight == texture.skinheight &&
+				other.size == texture.size && std::memcmp(other.pdata, texture.pdata, texture.size) == 0)
+			{
+				duplicates[i] = j;
+				break;
+			}
+		}
+		if (duplicates[i] == i)
+			candidates.push_back(i);
+	}
+	return duplicates;
+}
+
+// Keeps one copy of every set of duplicate textures. Skin references that end up showing the same texture
+// in every skin family are merged as well, along with the meshes using them
+static void merge_duplicate_textures(QC &qc, const std::vector<int> &duplicates)
+{
+	std::vector<int> textureindex(g_textures.size());
+	std::vector<Texture> textures;
+	int saved = 0;
+	for (int i = 0; i < g_textures.size(); i++)
+	{
+		if (duplicates[i] == i)
+		{
+			textureindex[i] = static_cast<int>(textures.size());
+			textures.push_back(g_textures[i]);
+		}
+		else
+		{
+			textureindex[i] = textureindex[duplicates[i]];
+			saved += g_textures[i].size;
+			std::free(g_textures[i].pdata);
+		}
+	}
+	if (textures.size() == g_textures.size())
+		return;
+	printf("merged    %zu duplicate textures (%d bytes saved)\n", g_textures.size() - textures.size(), saved);
+	g_textures = std::move(textures);
+
+	for (int i = 0; i < g_skinfamiliescount; i++)
+	{
+		for (int j = 0; j < g_skinrefcount; j++)
+		{
+			g_skinref[i][j] = textureindex[g_skinref[i][j]];
+		}
+	}
+
+	// columns are compacted in place, a column is only ever moved to a lower index
+	std::vector<int> refindex(g_skinrefcount);
+	int numrefs = 0;
+	for (int j = 0; j < g_skinrefcount; j++)
+	{
+		refindex[j] = -1;
+		for (int k = 0; k < numrefs && refindex[j] == -1; k++)
+		{
+			bool same = true;
+			for (int i = 0; i < g_skinfamiliescount && same; i++)
+				same = g_skinref[i][k] == g_skinref[i][j];
+			if (same)
+				refindex[j] = k;
+		}
+		if (refindex[j] != -1)
+			continue;
+		for (int i = 0; i < g_skinfamiliescount; i++)
+			g_skinref[i][numrefs] = g_skinref[i][j];
+		refindex[j] = numrefs++;
+	}
+	g_skinrefcount = numrefs;
+
+	for (auto *submodel : qc.submodels)
+	{
+		for (auto &normal : submodel->normals)
+		{
+			normal.skinref = refindex[normal.skinref];
+		}
+		for (int j = 0; j < submodel->nummesh; j++)
+		{
+			Mesh *pmesh = submodel->pmeshes[j];
+			pmesh->skinref = refindex[pmesh->skinref];
+			for (int k = 0; k < j; k++)
+			{
+				Mesh *pfirst = submodel->pmeshes[k];
+				if (pfirst->skinref != pmesh->skinref)
+					continue;
+				// append the triangles to the first mesh using the skin reference
+				pfirst->triangles = static_cast<TriangleVert(*)[3]>(std::realloc(
+					pfirst->triangles, (pfirst->numtris + pmesh->numtris) * sizeof(*pfirst->triangles)));
+				std::memcpy(&pfirst->triangles[pfirst->numtris], pmesh->triangles, pmesh->numtris * sizeof(*pmesh->triangles));
+				pfirst->numtris += pmesh->numtris;
+				pfirst->alloctris = pfirst->numtris;
+				std::free(pmesh->triangles);
+				std::free(pmesh);
+				for (int m = j + 1; m < submodel->nummesh; m++)
+					submodel->pmeshes[m - 1] = submodel->pmeshes[m];
+				submodel->nummesh--;
+				j--;
+				break;
+			}
+		}
+	}
+}
+
 static void build_reference(const Model *pmodel)
 {
 	Vector3 bone_angles{};
@@ -1380,7 +2218,7 @@ static void build_reference(const Model *pmodel)
 	}
 }
 
-static void parse_smd_triangles(const QC &qc, Model *pmodel)
+static void parse_smd_triangles(const QC &qc, Model *pmodel, SmdCacheData *record)
 {
 	Vector3 vmin{99999, 99999, 99999};
 
@@ -1392,8 +2230,7 @@ static void parse_smd_triangles(const QC &qc, Model *pmodel)
 	// load the base triangles
 	while (true)
 	{
-		if (fgets(g_currentsmdline, sizeof(g_currentsmdline), g_smdfile) !=
-			nullptr)
+		if (read_smd_line())
 		{
 			TriangleVert *ptriangle_vert;
 			int parent_bone;
@@ -1415,6 +2252,15 @@ static void parse_smd_triangles(const QC &qc, Model *pmodel)
 
 			Mesh *pmesh = find_mesh_by_texture(pmodel, material);
 
+			SmdCacheTriangle cached_triangle{};
+			if (record)
+			{
+				auto it = std::find(record->materials.begin(), record->materials.end(), material);
+				cached_triangle.material = static_cast<int>(it - record->materials.begin());
+				if (it == record->materials.end())
+					record->materials.push_back(material);
+			}
+
 			for (int j = 0; j < 3; j++)
 			{
 				if (g_flaginvertnormals)
@@ -1424,8 +2270,7 @@ static void parse_smd_triangles(const QC &qc, Model *pmodel)
 					ptriangle_vert =
 						find_mesh_triangle_by_index(pmesh, pmesh->numtris) + 2 - j;
 
-				if (fgets(g_currentsmdline, sizeof(g_currentsmdline), g_smdfile) !=
-					nullptr)
+				if (read_smd_line())
 				{
 					Vertex triangle_vertex{};
 					Normal triangle_normal{};
@@ -1468,6 +2313,10 @@ static void parse_smd_triangles(const QC &qc, Model *pmodel)
 							tmp, g_bonefixup[triangle_vertex.bone_id].inv_matrix);
 						triangle_normal.pos.normalize();
 
+						// recorded before find_vertex_index rounds the position
+						cached_triangle.verts[j] = {parent_bone, triangle_vertex.pos, triangle_normal.pos,
+													ptriangle_vert->u, ptriangle_vert->v};
+
 						ptriangle_vert->normindex =
 							find_vertex_normal_index(pmodel, &triangle_normal);
 						ptriangle_vert->vertindex =
@@ -1482,6 +2331,8 @@ static void parse_smd_triangles(const QC &qc, Model *pmodel)
 			}
 
 			pmesh->numtris++;
+			if (record)
+				record->triangles.push_back(cached_triangle);
 		}
 		else
 		{
@@ -1489,6 +2340,8 @@ static void parse_smd_triangles(const QC &qc, Model *pmodel)
 		}
 	}
 
+	if (record)
+		record->lowest = vmin[2];
 	if (vmin[2] != 0.0)
 	{
 		printf("Lowest vector at %f\n", vmin[2]);
@@ -1496,18 +2349,16 @@ static void parse_smd_triangles(const QC &qc, Model *pmodel)
 }
 
 static void parse_smd_reference_skeleton(const QC &qc, std::vector<Node> &nodes,
-										 std::vector<Bone> &bones,
-										 std::filesystem::path &path)
+										 std::vector<Bone> &bones)
 {
-	std::ifstream smdstream{path};
-	std::string line, cmd;
+	std::string cmd;
 	int node;
 	float posX, posY, posZ, rotX, rotY, rotZ;
 
-	while (std::getline(smdstream, line))
+	while (read_smd_line())
 	{
 		g_smdlinecount++;
-		std::istringstream iss{line};
+		std::istringstream iss{g_currentsmdline};
 
 		if (iss >> node >> posX >> posY >> posZ >> rotX >> rotY >> rotZ)
 		{
@@ -1520,9 +2371,12 @@ static void parse_smd_reference_skeleton(const QC &qc, std::vector<Node> &nodes,
 			bones.back().rot = Vector3{rotX, rotY, rotZ};
 			clip_rotations(bones.back().rot);
 		}
-		else if (iss >> cmd >> node && case_insensitive_compare(cmd, "end"))
+		else
 		{
-			return;
+			iss.clear();
+			iss.seekg(0);
+			if (iss >> cmd && case_insensitive_compare(cmd, "end"))
+				return;
 		}
 	}
 }
@@ -1533,8 +2387,7 @@ static int parse_smd_nodes(const QC &qc, std::vector<Node> &nodes)
 	std::string bone_name;
 	int parent;
 
-	while (fgets(g_currentsmdline, sizeof(g_currentsmdline), g_smdfile) !=
-		   nullptr)
+	while (read_smd_line())
 	{
 		g_smdlinecount++;
 		std::istringstream iss{g_currentsmdline};
@@ -1567,6 +2420,89 @@ static int parse_smd_nodes(const QC &qc, std::vector<Node> &nodes)
 	return 0;
 }
 
+// Cache file for SMD contents parsed with the given options
+static std::filesystem::path smd_cache_path(const std::string &kind, std::uint64_t hash, std::uint64_t options)
+{
+	char name[64];
+	std::snprintf(name, sizeof(name), "%s-%016llx-%016llx.smdc", kind.c_str(),
+				  static_cast<unsigned long long>(hash), static_cast<unsigned long long>(options));
+	return g_smdcachedir / name;
+}
+
+static void load_smd_cache_nodes(const SmdCacheFile &file, std::vector<Node> &nodes)
+{
+	const SmdCacheHeader &header = file.header();
+	const SmdCacheNode *cached_nodes = file.at<SmdCacheNode>(header.nodeindex);
+	nodes.resize(header.numnodes);
+	for (int i = 0; i < header.numnodes; i++)
+	{
+		nodes[i].name = file.string(cached_nodes[i].nameindex);
+		nodes[i].parent = cached_nodes[i].parent;
+		nodes[i].mirrored = cached_nodes[i].mirrored;
+	}
+}
+
+// The QC options applied while parsing a reference
+static std::uint64_t reference_options_hash(const QC &qc)
+{
+	std::string options;
+	options.append((const char *)&qc.sequence_origin, sizeof(qc.sequence_origin));
+	options.append((const char *)&qc.scale_body_and_sequence, sizeof(qc.scale_body_and_sequence));
+	for (auto &bone : qc.mirroredbones)
+	{
+		options += to_lowercase(bone) + '\n';
+	}
+	return hash_bytes(options.data(), options.size());
+}
+
+// Replays the cached triangles through the same mesh, vertex and normal lookups as parse_smd_triangles
+static bool load_reference_smd_cache(const std::filesystem::path &path, std::uint64_t hash, Model *pmodel)
+{
+	SmdCacheFile file;
+	if (!file.open(path, hash))
+		return false;
+
+	const SmdCacheHeader &header = file.header();
+	load_smd_cache_nodes(file, pmodel->nodes);
+	const Bone *bones = file.at<Bone>(header.boneindex);
+	pmodel->skeleton.assign(bones, bones + header.numbones);
+
+	g_unique_vertices.clear();
+	g_unique_normals.clear();
+
+	const int *materials = file.at<int>(header.materialindex);
+	const SmdCacheTriangle *triangles = file.at<SmdCacheTriangle>(header.triangleindex);
+	for (int i = 0; i < header.numtriangles; i++)
+	{
+		Mesh *pmesh = find_mesh_by_texture(pmodel, file.string(materials[triangles[i].material]));
+
+		for (int j = 0; j < 3; j++)
+		{
+			TriangleVert *ptriangle_vert;
+			if (g_flaginvertnormals)
+				ptriangle_vert = find_mesh_triangle_by_index(pmesh, pmesh->numtris) + j;
+			else // quake wants them in the reverse order
+				ptriangle_vert = find_mesh_triangle_by_index(pmesh, pmesh->numtris) + 2 - j;
+
+			const SmdCacheVertex &cached = triangles[i].verts[j];
+			Vertex triangle_vertex{cached.bone, cached.pos};
+			Normal triangle_normal{pmesh->skinref, cached.bone, cached.normal};
+			ptriangle_vert->u = cached.u;
+			ptriangle_vert->v = cached.v;
+			ptriangle_vert->normindex = find_vertex_normal_index(pmodel, &triangle_normal);
+			ptriangle_vert->vertindex = find_vertex_index(pmodel, &triangle_vertex);
+		}
+
+		pmesh->numtris++;
+	}
+
+	if (header.lowest != 0.0)
+	{
+		printf("Lowest vector at %f\n", header.lowest);
+	}
+	return true;
+}
+
 static void parse_smd_reference(const QC &qc, std::filesystem::path &smd_ref_path, Model *pmodel)
 {
 	std::filesystem::path smd_path;
@@ -1588,20 +2524,29 @@ static void parse_smd_reference(const QC &qc, std::filesystem::path &smd_ref_pat
 		smd_path = smd_ref_path;
 	}
 
-	if (!std::filesystem::exists(smd_path))
+	if (!g_fileprovider->exists(smd_path))
 	{
 		error("Cannot find \"" + pmodel->name + "\" in " + smd_ref_path.string() + "\"\n");
 	}
 
 	printf("Grabbing reference: %s\n\n", smd_path.string().c_str());
 
-	if ((g_smdfile = fopen(smd_path.string().c_str(), "r")) == nullptr)
+	load_smd_file(smd_path);
+
+	std::uint64_t hash = 0;
+	std::filesystem::path cache_file;
+	if (!g_smdcachedir.empty())
 	{
-		fprintf(stderr, "reader: could not open file '%s'\n", smd_path.c_str());
+		hash = hash_bytes(g_smdbuffer.data(), g_smdbuffer.size());
+		cache_file = smd_cache_path("ref", hash, reference_options_hash(qc));
+		if (load_reference_smd_cache(cache_file, hash, pmodel))
+			return;
 	}
 
-	while (fgets(g_currentsmdline, sizeof(g_currentsmdline), g_smdfile) !=
-		   nullptr)
+	SmdCacheData record;
+	int numtrianglesections = 0;
+
+	while (read_smd_line())
 	{
 		g_smdlinecount++;
 		std::istringstream iss{g_currentsmdline};
@@ -1627,15 +2572,22 @@ static void parse_smd_reference(const QC &qc, std::filesystem::path &smd_ref_pat
 		}
 		else if (case_insensitive_compare(cmd, "skeleton"))
 		{
-			parse_smd_reference_skeleton(qc, pmodel->nodes, pmodel->skeleton,
-										 smd_path);
+			parse_smd_reference_skeleton(qc, pmodel->nodes, pmodel->skeleton);
 		}
 		else if (case_insensitive_compare(cmd, "triangles"))
 		{
-			parse_smd_triangles(qc, pmodel);
+			parse_smd_triangles(qc, pmodel, cache_file.empty() ? nullptr : &record);
+			numtrianglesections++;
 		}
 	}
-	fclose(g_smdfile);
+
+	// the cache replays a single triangles block
+	if (!cache_file.empty() && numtrianglesections <= 1)
+	{
+		record.nodes = pmodel->nodes;
+		record.skeleton = pmodel->skeleton;
+		g_cachebyteswritten += save_smd_cache(cache_file, hash, record);
+	}
 }
 
 static void cmd_eyeposition(QC &qc, std::string &token)
@@ -1664,6 +2616,26 @@ static void cmd_modelname(QC &qc, std::string &token)
 	qc.modelname = token;
 }
 
+// The following sequences are stored in their own <model>NN.mdl file
+static void cmd_sequencegroup(QC &qc, std::string &token)
+{
+	get_token(false, token);
+	if (qc.sequencegroups.size() >= MAXSTUDIOGROUPS)
+		error("Too many sequence groups (max " + std::to_string(MAXSTUDIOGROUPS) + ")");
+	qc.sequencegroups.push_back(token);
+}
+
+static void cmd_externaltextures(QC &qc)
+{
+	qc.externaltextures = true;
+}
+
+static void cmd_sequencegroupsize(QC &qc, std::string &token)
+{
+	get_token(false, token);
+	qc.sequencegroupsize = std::stoi(token) * 1024;
+}
+
 static void cmd_body_option_studio(QC &qc, std::string &token)
 {
 	if (!get_token(false, token))
@@ -1772,61 +2744,82 @@ static void cmd_body(QC &qc, std::string &token)
 	cmd_body_option_studio(qc, token);
 }
 
-static void parse_smd_animation_skeleton(const QC &qc, Animation &anim)
+// Parses the time blocks of the skeleton block set in parsed.parsedframes and not already parsed in previous,
+// then merges the frames of previous. Frames are stored by time starting at parsed.firstframe
+static void parse_smd_animation_skeleton(const QC &qc, const std::string &name, CachedAnimation &parsed, const CachedAnimation &previous)
 {
 	Vector3 pos;
 	Vector3 rot;
 	int index;
 	int t = -99999999;
-	int start = 99999;
-	int end = 0;
+	int start = MAXSTUDIOANIMATIONS;
+	int end = -1;
+
+	parsed.pos.assign(parsed.nodes.size(), {});
+	parsed.rot.assign(parsed.nodes.size(), {});
 
-	for (index = 0; index < anim.nodes.size(); index++)
+	const auto resize_frames = [&parsed](int frames)
 	{
-		anim.pos[index] =
-			(Vector3 *)std::calloc(MAXSTUDIOANIMATIONS, sizeof(Vector3));
-		anim.rot[index] =
-			(Vector3 *)std::calloc(MAXSTUDIOANIMATIONS, sizeof(Vector3));
-	}
+		if (frames > parsed.framemask.size())
+		{
+			parsed.framemask.resize(frames);
+			for (int j = 0; j < parsed.nodes.size(); j++)
+			{
+				parsed.pos[j].resize(frames);
+				parsed.rot[j].resize(frames);
+			}
+		}
+	};
+	const auto wanted = [&parsed, &previous](int time)
+	{
+		return time >= 0 && time < MAXSTUDIOANIMATIONS && parsed.parsedframes[time] && !previous.parsedframes[time];
+	};
 
 	const float cosz = std::cos(qc.rotate);
 	const float sinz = std::sin(qc.rotate);
 
-	while (fgets(g_currentsmdline, sizeof(g_currentsmdline), g_smdfile) !=
-		   nullptr)
+	while (read_smd_line())
 	{
 		g_smdlinecount++;
 		std::istringstream iss{g_currentsmdline};
 		if (iss >> index >> pos.x >> pos.y >> pos.z >> rot.x >> rot.y >> rot.z)
 		{
-			if (t >= anim.startframe && t <= anim.endframe)
+			if (wanted(t))
 			{
-				if (anim.nodes[index].parent == -1)
+				if (index < 0 || index >= parsed.nodes.size())
+				{
+					error("Bogus bone index at line " + std::to_string(g_smdlinecount));
+				}
+				resize_frames(t + 1);
+				Vector3 &frame_pos = parsed.pos[index][t];
+
+				if (parsed.nodes[index].parent == -1)
 				{
 					pos -= qc.sequence_origin; // adjust vertex to origin
-					anim.pos[index][t].x = cosz * pos.x - sinz * pos.y;
-					anim.pos[index][t].y = sinz * pos.x + cosz * pos.y;
-					anim.pos[index][t].z = pos.z;
+					frame_pos.x = cosz * pos.x - sinz * pos.y;
+					frame_pos.y = sinz * pos.x + cosz * pos.y;
+					frame_pos.z = pos.z;
 					// rotate model
 					rot.z += qc.rotate;
 				}
 				else
 				{
-					anim.pos[index][t] = pos;
+					frame_pos = pos;
 				}
 				if (t > end)
 					end = t;
 				if (t < start)
 					start = t;
+				parsed.framemask[t] = 1;
 
-				if (anim.nodes[index].mirrored)
-					anim.pos[index][t] = anim.pos[index][t] * -1.0;
+				if (parsed.nodes[index].mirrored)
+					frame_pos = frame_pos * -1.0;
 
-				anim.pos[index][t] *= qc.scale_body_and_sequence; // scale vertex
+				frame_pos *= qc.scale_body_and_sequence; // scale vertex
 
 				clip_rotations(rot);
 
-				anim.rot[index][t] = rot;
+				parsed.rot[index][t] = rot;
 			}
 		}
 		else
@@ -1839,11 +2832,36 @@ static void parse_smd_animation_skeleton(const QC &qc, Animation &anim)
 			if (case_insensitive_compare(cmd, "time"))
 			{
 				t = index;
+				if (!wanted(t))
+					skip_smd_frame();
 			}
 			else if (case_insensitive_compare(cmd, "end"))
 			{
-				anim.startframe = start;
-				anim.endframe = end;
+				for (int i = 0; i < previous.framemask.size(); i++)
+				{
+					if (!previous.framemask[i])
+						continue;
+					const int time = previous.firstframe + i;
+					resize_frames(time + 1);
+					for (int j = 0; j < parsed.nodes.size(); j++)
+					{
+						parsed.pos[j][time] = previous.pos[j][i];
+						parsed.rot[j][time] = previous.rot[j][i];
+					}
+					parsed.framemask[time] = 1;
+					start = std::min(start, time);
+					end = std::max(end, time);
+				}
+
+				// drop the empty frames before the first time block
+				const int skipped = end < start ? 0 : start;
+				parsed.firstframe = skipped;
+				parsed.framemask.erase(parsed.framemask.begin(), parsed.framemask.begin() + skipped);
+				for (int j = 0; j < parsed.nodes.size(); j++)
+				{
+					parsed.pos[j].erase(parsed.pos[j].begin(), parsed.pos[j].begin() + skipped);
+					parsed.rot[j].erase(parsed.rot[j].begin(), parsed.rot[j].begin() + skipped);
+				}
 				return;
 			}
 			else
@@ -1853,33 +2871,147 @@ static void parse_smd_animation_skeleton(const QC &qc, Animation &anim)
 			}
 		}
 	}
-	error("unexpected EOF: " + anim.name);
+	error("unexpected EOF: " + name);
 }
 
-static void shift_option_animation(Animation &anim)
+// Copies the sequence frame range out of a parsed SMD, so one parse serves every sequence using the file
+static void crop_animation(const CachedAnimation &parsed, Animation &anim)
 {
-	const int size = (anim.endframe - anim.startframe + 1) * sizeof(Vector3);
+	int start = MAXSTUDIOANIMATIONS;
+	int end = -1;
+	const int first = std::max(anim.startframe, parsed.firstframe);
+	const int last = std::min(anim.endframe, parsed.firstframe + static_cast<int>(parsed.framemask.size()) - 1);
+	for (int t = first; t <= last; t++)
+	{
+		if (parsed.framemask[t - parsed.firstframe])
+		{
+			start = std::min(start, t);
+			end = std::max(end, t);
+		}
+	}
+	if (end < start)
+	{
+		error("no animation frames: " + anim.name + "\n");
+	}
+
+	anim.nodes = parsed.nodes;
+	anim.startframe = start;
+	anim.endframe = end;
+
+	const std::size_t size = (end - start + 1) * sizeof(Vector3);
 	for (int j = 0; j < anim.nodes.size(); j++)
 	{
-		Vector3 *ppos = (Vector3 *)std::calloc(1, size);
-		Vector3 *prot = (Vector3 *)std::calloc(1, size);
+		anim.pos[j] = (Vector3 *)std::malloc(size);
+		anim.rot[j] = (Vector3 *)std::malloc(size);
+		std::memcpy(anim.pos[j], &parsed.pos[j][start - parsed.firstframe], size);
+		std::memcpy(anim.rot[j], &parsed.rot[j][start - parsed.firstframe], size);
+	}
+}
+
+// Every QC option applied while parsing the animation, the frame range is applied afterwards
+static std::uint64_t animation_options_hash(const QC &qc)
+{
+	std::string options;
+	options.append((const char *)&qc.rotate, sizeof(qc.rotate));
+	options.append((const char *)&qc.sequence_origin, sizeof(qc.sequence_origin));
+	options.append((const char *)&qc.scale_body_and_sequence, sizeof(qc.scale_body_and_sequence));
+	for (auto &bone : qc.mirroredbones)
+	{
+		options += to_lowercase(bone) + '\n';
+	}
+	return hash_bytes(options.data(), options.size());
+}
 
-		std::memcpy(ppos, &anim.pos[j][anim.startframe], size);
-		std::memcpy(prot, &anim.rot[j][anim.startframe], size);
+// The SMD path plus every QC option applied while parsing the animation
+static std::string animation_cache_key(const QC &qc, const std::filesystem::path &smd_path)
+{
+	return smd_path.generic_string() + '|' + std::to_string(animation_options_hash(qc));
+}
 
-		free(anim.pos[j]);
-		free(anim.rot[j]);
+static bool load_animation_smd_cache(const std::filesystem::path &path, std::uint64_t hash, CachedAnimation &parsed)
+{
+	SmdCacheFile file;
+	if (!file.open(path, hash) || !file.header().animindex)
+		return false;
+
+	const SmdCacheHeader &header = file.header();
+	load_smd_cache_nodes(file, parsed.nodes);
+	const std::uint8_t *parsedframes = file.at<std::uint8_t>(header.parsedframesindex);
+	for (int t = 0; t < MAXSTUDIOANIMATIONS; t++)
+	{
+		parsed.parsedframes[t] = (parsedframes[t / 8] >> (t % 8)) & 1;
+	}
+	parsed.firstframe = header.firstframe;
+	const std::uint8_t *framemask = file.at<std::uint8_t>(header.framemaskindex);
+	parsed.framemask.assign(framemask, framemask + header.numframes);
+
+	const int *offsets = file.at<int>(header.animindex);
+	parsed.pos.resize(header.numnodes);
+	parsed.rot.resize(header.numnodes);
+	for (int j = 0; j < header.numnodes; j++)
+	{
+		const Vector3 *frames = file.at<Vector3>(offsets[j]);
+		parsed.pos[j].assign(frames, frames + header.numframes);
+		parsed.rot[j].assign(frames + header.numframes, frames + 2 * header.numframes);
+	}
+	return true;
+}
 
-		anim.pos[j] = ppos;
-		anim.rot[j] = prot;
+static void save_animation_smd_cache(const std::filesystem::path &path, std::uint64_t hash, const CachedAnimation &parsed)
+{
+	SmdCacheData data;
+	data.nodes = parsed.nodes;
+	data.parsedframes = parsed.parsedframes;
+	data.firstframe = parsed.firstframe;
+	data.framemask = parsed.framemask;
+	for (int j = 0; j < parsed.nodes.size(); j++)
+	{
+		data.pos.push_back(parsed.pos[j].data());
+		data.rot.push_back(parsed.rot[j].data());
 	}
+	g_cachebyteswritten += save_smd_cache(path, hash, data);
 }
 
-static void parse_smd_animation(const QC &qc, std::filesystem::path &sequence_smd_path, Animation &anim)
+// Parses the SMD in g_smdbuffer
+static void parse_smd_animation_file(const QC &qc, const std::string &name, CachedAnimation &parsed, const CachedAnimation &previous)
 {
-	std::filesystem::path smd_path;
 	std::string cmd;
 	int smd_version;
+
+	while (read_smd_line())
+	{
+		g_smdlinecount++;
+		std::istringstream iss{g_currentsmdline};
+
+		if (!(iss >> cmd))
+			continue;
+		if (case_insensitive_compare(cmd, "version"))
+		{
+			if (!(iss >> smd_version))
+			{
+				error("Missing SMD version number.\n");
+				return;
+			}
+			if (smd_version != 1)
+			{
+				error("Unsupported SMD version: " + std::to_string(smd_version) + "\n");
+				return;
+			}
+		}
+		else if (case_insensitive_compare(cmd, "nodes"))
+		{
+			parse_smd_nodes(qc, parsed.nodes);
+		}
+		else if (case_insensitive_compare(cmd, "skeleton"))
+		{
+			parse_smd_animation_skeleton(qc, name, parsed, previous);
+		}
+	}
+}
+
+static void parse_smd_animation(const QC &qc, std::filesystem::path &sequence_smd_path, Animation &anim)
+{
+	std::filesystem::path smd_path;
 	g_smdlinecount = 0;
 
 	if (!case_insensitive_compare(sequence_smd_path.extension().string(), ".smd"))
@@ -1897,51 +3029,89 @@ static void parse_smd_animation(const QC &qc, std::filesystem::path &sequence_sm
 		smd_path = sequence_smd_path;
 	}
 
-	if (!std::filesystem::exists(smd_path))
+	if (!g_fileprovider->exists(smd_path))
 	{
 		error("Cannot find \"" + anim.name + ".smd\" in \"" + smd_path.string() + "\"\n");
 	}
 
 	printf("Grabbing animation: %s\n", smd_path.string().c_str());
 
-	if ((g_smdfile = fopen(smd_path.string().c_str(), "r")) == nullptr)
+	// sequences using the same file share one parse, kept in the compile cache when there is one
+	const std::string key = animation_cache_key(qc, smd_path);
+	CachedAnimation &parsed = (g_compilecache ? g_compilecache->animations : g_compileanimations)[key];
+	std::uint64_t hash = parsed.hash;
+	bool loaded = false;
+	const bool first_use = g_checkedanimations.insert(key).second;
+	if (first_use)
 	{
-		fprintf(stderr, "reader: could not open file '%s'\n", smd_path.c_str());
-		error("Something went wrong");
+		// first use in this compile, an earlier parse is only valid for the same file contents
+		load_smd_file(smd_path);
+		loaded = true;
+		hash = hash_bytes(g_smdbuffer.data(), g_smdbuffer.size());
 	}
 
-	while (fgets(g_currentsmdline, sizeof(g_currentsmdline), g_smdfile) !=
-		   nullptr)
+	// only the time blocks inside the sequence frame range are parsed
+	std::bitset<MAXSTUDIOANIMATIONS> requested;
+	for (int t = std::max(anim.startframe, 0); t <= std::min(anim.endframe, MAXSTUDIOANIMATIONS - 1); t++)
 	{
-		g_smdlinecount++;
-		std::istringstream iss{g_currentsmdline};
+		requested[t] = true;
+	}
+	const bool reused = parsed.hash == hash && (requested & ~parsed.parsedframes).none();
+	if (!reused)
+	{
+		// a file cropped by several sequences of the model is parsed whole on the second miss, instead of rescanning it per sequence
+		if (!first_use)
+		{
+			requested.set();
+		}
 
-		if (!(iss >> cmd))
-			continue;
-		if (case_insensitive_compare(cmd, "version"))
+		// an earlier parse of the same contents is kept, only the missing time blocks are parsed and merged into it
+		CachedAnimation previous;
+		if (parsed.hash == hash)
 		{
-			if (!(iss >> smd_version))
-			{
-				error("Missing SMD version number.\n");
-				return;
-			}
-			if (smd_version != 1)
+			previous = std::move(parsed);
+		}
+
+		std::filesystem::path cache_file;
+		if (!g_smdcachedir.empty())
+		{
+			cache_file = smd_cache_path("anim", hash, animation_options_hash(qc));
+			CachedAnimation on_disk;
+			if (load_animation_smd_cache(cache_file, hash, on_disk) &&
+				(previous.parsedframes & ~on_disk.parsedframes).none())
 			{
-				error("Unsupported SMD version: " + std::to_string(smd_version) + "\n");
-				return;
+				previous = std::move(on_disk);
 			}
 		}
-		else if (case_insensitive_compare(cmd, "nodes"))
+
+		if ((requested & ~previous.parsedframes).none())
 		{
-			parse_smd_nodes(qc, anim.nodes);
+			parsed = std::move(previous);
 		}
-		else if (case_insensitive_compare(cmd, "skeleton"))
+		else
 		{
-			parse_smd_animation_skeleton(qc, anim);
-			shift_option_animation(anim);
+			if (!loaded)
+			{
+				load_smd_file(smd_path);
+			}
+			parsed = CachedAnimation{};
+			parsed.parsedframes = previous.parsedframes | requested;
+			parse_smd_animation_file(qc, anim.name, parsed, previous);
+			if (!cache_file.empty())
+			{
+				save_animation_smd_cache(cache_file, hash, parsed);
+			}
 		}
+		// set last, so a failed parse is never reused
+		parsed.hash = hash;
+	}
+
+	if (g_compilecache)
+	{
+		(reused ? g_compilecache->animation_hits : g_compilecache->animation_misses)++;
 	}
-	fclose(g_smdfile);
+
+	crop_animation(parsed, anim);
 }
 
 static int cmd_sequence_option_event(std::string &token, Sequence &seq)
@@ -2068,7 +3238,7 @@ static int cmd_sequence(QC &qc, std::string &token)
 
 	qc.rotate = qc.origin_rotation;
 	newseq.fps = 30.0;
-	newseq.seqgroup = 0; // 0 since $sequencegroup is deprecated
+	newseq.seqgroup = static_cast<int>(qc.sequencegroups.size()) - 1;
 	newseq.blendstart[0] = 0.0;
 	newseq.blendend[0] = 1.0;
 
@@ -2559,6 +3729,18 @@ static void parse_qc_file(const std::filesystem::path &working_dir, QC &qc)
 		{
 			cmd_sequence(qc, token);
 		}
+		else if (token == "$sequencegroup")
+		{
+			cmd_sequencegroup(qc, token);
+		}
+		else if (token == "$sequencegroupsize")
+		{
+			cmd_sequencegroupsize(qc, token);
+		}
+		else if (token == "$externaltextures")
+		{
+			cmd_externaltextures(qc);
+		}
 		else if (token == "$eyeposition")
 		{
 			cmd_eyeposition(qc, token);
@@ -2618,76 +3800,312 @@ static void parse_qc_file(const std::filesystem::path &working_dir, QC &qc)
 	}
 }
 
-static void usage(const char *program_name)
+static void reset_compiler_state()
 {
-	std::cerr
-		<< "Usage: " << program_name << " <inputfile.qc> <flags>\n"
-		<< "  Flags:\n"
-		<< "    [-f]                Invert normals\n"
-		<< "    [-a <angle>]        Set vertex normal blend angle override\n"
-		<< "    [-b]                Keep all unused bones\n";
-	std::exit(EXIT_FAILURE);
+	for (auto &row : g_xnode)
+		row.fill(0);
+	g_numxnodes = 0;
+	g_bonetable.clear();
+	g_textures.clear();
+	for (auto &row : g_skinref)
+		row.fill(0);
+	g_skinrefcount = 0;
+	g_skinfamiliescount = 0;
+	g_unique_vertices.clear();
+	g_unique_normals.clear();
+	g_compileanimations.clear();
+	g_checkedanimations.clear();
+	g_smdlinecount = 0;
 }
 
-int main(int argc, char **argv)
+// Frees everything allocated while compiling qc, so repeated compiles don't leak
+static void free_model_data(QC &qc)
 {
-	if (argc < 2)
-	{
-		usage(argv[0]);
-	}
-
-	std::filesystem::path qc_input_path = argv[1];
-	if (qc_input_path.extension() != ".qc")
+	for (auto &anim : qc.sequenceAnimationOptions)
 	{
-		error("The first argument must be a .qc file");
+		for (int j = 0; j < anim.nodes.size(); j++)
+		{
+			std::free(anim.pos[j]);
+			std::free(anim.rot[j]);
+		}
 	}
-
-	for (int i = 2; i < argc; ++i)
+	for (auto &sequence : qc.sequences)
 	{
-		if (argv[i][0] == '-')
+		for (auto &anim : sequence.anims)
 		{
-			switch (argv[i][1])
+			for (int j = 0; j < g_bonetable.size(); j++)
 			{
-			case 'f':
-				g_flaginvertnormals = true;
-				break;
-			case 'a':
-				if (i + 1 >= argc)
-				{
-					error("Missing value for -a flag.");
-				}
-				try
-				{
-					g_flagnormalblendangle = std::cos(to_radians(std::stof(argv[++i])));
-				}
-				catch (const std::invalid_argument &)
+				for (int k = 0; k < DEGREESOFFREEDOM; k++)
 				{
-					error("Invalid value for -a flag. Expected a numeric angle.");
+					std::free(anim.anims[j][k]);
 				}
-				break;
-			case 'b':
-				g_flagkeepallbones = true;
-				break;
-			default:
-				error("Unknown flag: " + std::string(argv[i]));
 			}
 		}
-		else
+	}
+	for (auto *pdefault : g_defaultanimations)
+	{
+		std::free(pdefault);
+	}
+	g_defaultanimations.clear();
+	g_compileanimations.clear();
+
+	for (auto *submodel : qc.submodels)
+	{
+		for (int i = 0; i < submodel->nummesh; i++)
+		{
+			std::free(submodel->pmeshes[i]->triangles);
+			std::free(submodel->pmeshes[i]);
+		}
+		delete submodel;
+	}
+	qc.submodels.clear();
+
+	for (auto &texture : g_textures)
+	{
+		std::free(texture.pdata);
+		texture.pdata = nullptr;
+	}
+}
+
+// Paths load_skin loads the textures from
+static std::vector<std::filesystem::path> texture_files(const std::filesystem::path &cdtexture, const std::vector<Texture> &textures)
+{
+	std::vector<std::filesystem::path> files;
+	for (auto &texture : textures)
+	{
+		files.push_back((cdtexture / texture.name).lexically_normal());
+	}
+	return files;
+}
+
+// Hash of the QC path, the compile options and the contents of every dependency besides the textures,
+// a dependency that no longer exists hashes differently from any contents it had
+static std::uint64_t model_inputs_hash(FileProvider &source, const CompileInput &input, const std::vector<std::filesystem::path> &dependencies,
+									   const std::vector<std::filesystem::path> &textures)
+{
+	const std::string qc_path = std::filesystem::absolute(input.qc_path).lexically_normal().generic_string();
+	std::uint64_t hash = hash_bytes(qc_path.data(), qc_path.size());
+	hash = hash_bytes(&input.invert_normals, sizeof(input.invert_normals), hash);
+	hash = hash_bytes(&input.normal_blend_angle, sizeof(input.normal_blend_angle), hash);
+	hash = hash_bytes(&input.keep_all_bones, sizeof(input.keep_all_bones), hash);
+	hash = hash_bytes(&input.anim_tolerance_pos, sizeof(input.anim_tolerance_pos), hash);
+	hash = hash_bytes(&input.anim_tolerance_rot, sizeof(input.anim_tolerance_rot), hash);
+	hash = hash_bytes(&input.sequence_group_size, sizeof(input.sequence_group_size), hash);
+	hash = hash_bytes(&input.external_textures, sizeof(input.external_textures), hash);
+	hash = hash_bytes(&input.dither_textures, sizeof(input.dither_textures), hash);
+	hash = hash_bytes(&input.max_texture_dim, sizeof(input.max_texture_dim), hash);
+	hash = hash_bytes(&input.texture_budget, sizeof(input.texture_budget), hash);
+	hash = hash_bytes(&input.section_align, sizeof(input.section_align), hash);
+	for (auto &dependency : dependencies)
+	{
+		if (std::find(textures.begin(), textures.end(), dependency) != textures.end())
+			continue;
+		const std::string path = dependency.generic_string();
+		const bool exists = source.exists(dependency);
+		hash = hash_bytes(path.data(), path.size(), hash);
+		hash = hash_bytes(&exists, sizeof(exists), hash);
+		if (!exists)
+			continue;
+		const std::vector<char> data = source.load(dependency);
+		hash = hash_bytes(data.data(), data.size(), hash);
+	}
+	return hash;
+}
+
+// When only textures changed since the previous compile of the QC, everything before the textures is reused
+// and only the textures are loaded and written again
+static bool rebuild_textures(FileProvider &source, const CompileInput &input, const CachedModel &cached, std::vector<std::byte> &mdl)
+{
+	StudioHeader header;
+	if (cached.mdl.size() < sizeof(header))
+		return false;
+	std::memcpy(&header, cached.mdl.data(), sizeof(header));
+	if (header.ident != IDSTUDIOHEADER || header.version != STUDIO_VERSION || static_cast<std::size_t>(header.length) != cached.mdl.size() ||
+		header.textureindex < 0 || header.textureindex > header.length || (header.textureindex == 0 && !input.texture_model))
+		return false;
+	if (model_inputs_hash(source, input, cached.dependencies, texture_files(cached.cdtexture, cached.textures)) != cached.hash)
+		return false;
+
+	QC qc{};
+	qc.cdtexture = cached.cdtexture;
+	qc.gamma = cached.gamma;
+	printf("\nGrabbing texture:\n");
+	g_textures = cached.textures;
+	std::vector<SkinFile> files = grab_skins(qc);
+	shrink_textures(files);
+	for (int i = 0; i < g_textures.size(); i++)
+	{
+		// the texture coordinates of the meshes are in pixels
+		const Texture &texture = g_textures[i];
+		if (texture.srcwidth != cached.textures[i].srcwidth || texture.srcheight != cached.textures[i].srcheight)
 		{
-			error("Unexpected argument: " + std::string(argv[i]));
+			printf("Texture %s changed size, recompiling\n", texture.name.c_str());
+			g_textures.clear();
+			return false;
 		}
 	}
+	resize_textures(qc, files);
+	// merged duplicates changed the meshes and skin references
+	if (find_duplicate_textures() != cached.duplicates)
+	{
+		printf("Duplicate textures changed, recompiling\n");
+		for (auto &resized : g_textures)
+			std::free(resized.pdata);
+		g_textures.clear();
+		return false;
+	}
+	g_skinref = cached.skinref;
+	g_skinrefcount = cached.skinrefcount;
+	g_skinfamiliescount = cached.skinfamiliescount;
+	merge_duplicate_textures(qc, cached.duplicates);
+
+	std::vector<std::byte> texture_model;
+	mdl = write_mdl_textures(cached.mdl, texture_model);
+	if (input.dependencies)
+		*input.dependencies = cached.dependencies;
+	if (input.sequence_groups)
+		*input.sequence_groups = cached.sequence_groups;
+	if (input.texture_model)
+		*input.texture_model = std::move(texture_model);
+	return true;
+}
+
+// Keeps the textures and skin families as set_skin_values left them, the model is stored after it was written
+static void store_cached_textures(const QC &qc, const std::vector<int> &duplicates, CachedModel &cached)
+{
+	cached.hash = 0;
+	cached.cdtexture = qc.cdtexture;
+	cached.gamma = qc.gamma;
+	cached.textures = g_textures;
+	for (auto &texture : cached.textures)
+	{
+		texture.pdata = nullptr;
+	}
+	cached.skinref = g_skinref;
+	cached.skinrefcount = g_skinrefcount;
+	cached.skinfamiliescount = g_skinfamiliescount;
+	cached.duplicates = duplicates;
+}
+
+static void store_cached_model(FileProvider &source, const CompileInput &input, const std::vector<std::filesystem::path> &dependencies,
+							   const std::vector<std::byte> &mdl, const std::vector<std::byte> &texture_model,
+							   const std::vector<std::vector<std::byte>> &sequence_groups, CachedModel &cached)
+{
+	cached.dependencies = dependencies;
+	cached.mdl = mdl;
+	cached.texture_model = texture_model;
+	cached.sequence_groups = sequence_groups;
+	cached.hash = model_inputs_hash(source, input, dependencies, texture_files(cached.cdtexture, cached.textures));
+}
+
+// Path an entry of the cache is keyed by, before the '|' of the keys that add options or names
+static bool cache_source_exists(const std::string &key)
+{
+	std::error_code ec;
+	return std::filesystem::exists(key.substr(0, key.find('|')), ec);
+}
+
+void prune_compile_cache(CompileCache &cache)
+{
+	const auto prune = [](auto &entries)
+	{
+		for (auto it = entries.begin(); it != entries.end();)
+			it = cache_source_exists(it->first) ? std::next(it) : entries.erase(it);
+	};
+	prune(cache.textures);
+	prune(cache.animations);
+	prune(cache.sequences);
+	prune(cache.models);
+}
 
+std::vector<std::byte> compile(const CompileInput &input)
+{
 	QC qc{};
-	std::filesystem::path qc_absolute_path = std::filesystem::absolute(qc_input_path);
+
+	// restore the previous provider and cache and release the model data even if the compile fails
+	struct CompileScope
+	{
+		QC &qc;
+		const CompileInput &input;
+		FileProvider *previous_provider = g_fileprovider;
+		CompileCache *previous_cache = g_compilecache;
+		~CompileScope()
+		{
+			free_model_data(qc);
+			g_fileprovider = previous_provider;
+			g_compilecache = previous_cache;
+			if (input.cache_bytes_written)
+				*input.cache_bytes_written = g_cachebyteswritten;
+		}
+	} compile_scope{qc, input};
+	g_cachebyteswritten = 0;
+	if (input.files)
+		g_fileprovider = input.files;
+	g_compilecache = input.cache;
+	g_smdcachedir = input.smd_cache_dir;
+	g_texturecachedir = input.texture_cache_dir;
+
+	// the inputs hash reads the dependencies straight from the source so they aren't recorded again
+	FileProvider &source = *g_fileprovider;
+	std::vector<std::filesystem::path> local_dependencies;
+	std::vector<std::filesystem::path> &dependencies = input.dependencies ? *input.dependencies : local_dependencies;
+	RecordingFileProvider recorder{source, dependencies, input.missing};
+	if (input.dependencies || input.missing || g_compilecache)
+		g_fileprovider = &recorder;
+
+	reset_compiler_state();
+	g_flaginvertnormals = input.invert_normals;
+	g_flagkeepallbones = input.keep_all_bones;
+	g_flagnormalblendangle = std::cos(to_radians(input.normal_blend_angle));
+	g_animtolerancepos = input.anim_tolerance_pos;
+	g_animtolerancerot = to_radians(input.anim_tolerance_rot);
+	g_flagdithertextures = input.dither_textures;
+	g_maxtexturedim = input.max_texture_dim;
+	g_texturebudget = input.texture_budget * 1024;
+	g_sectionalign = input.section_align;
+
+	std::filesystem::path qc_absolute_path = std::filesystem::absolute(input.qc_path);
 	std::filesystem::path working_dir = qc_absolute_path.parent_path();
 
+	g_compileqcpath = qc_absolute_path.lexically_normal().generic_string();
+	CachedModel *cached_model = g_compilecache ? &g_compilecache->models[g_compileqcpath] : nullptr;
+	std::vector<std::byte> rebuilt;
+	if (cached_model && rebuild_textures(source, input, *cached_model, rebuilt))
+	{
+		cached_model->mdl = rebuilt;
+		if (input.texture_model)
+			cached_model->texture_model = *input.texture_model;
+		return rebuilt;
+	}
+	// textures loaded by a failed rebuild may not be used by the full compile
+	dependencies.clear();
+
 	load_qc_file(qc_absolute_path);
 	parse_qc_file(working_dir, qc);
 	set_skin_values(qc);
+	const std::vector<int> duplicates = find_duplicate_textures();
+	if (cached_model)
+		store_cached_textures(qc, duplicates, *cached_model);
 	simplify_model(qc);
-
-	write_file(working_dir, qc);
-
-	return 0;
+	merge_duplicate_textures(qc, duplicates);
+
+	if (input.sequence_group_size > 0)
+		qc.sequencegroupsize = input.sequence_group_size * 1024;
+	if (input.external_textures)
+		qc.externaltextures = true;
+
+	std::vector<std::vector<std::byte>> sequence_groups;
+	std::vector<std::byte> texture_model;
+	std::vector<std::byte> mdl = write_mdl(qc, sequence_groups, texture_model);
+	if (!sequence_groups.empty() && !input.sequence_groups)
+		error("The model has sequence groups but CompileInput::sequence_groups is not set");
+	if (qc.externaltextures && !input.texture_model)
+		error("The model has external textures but CompileInput::texture_model is not set");
+	if (cached_model)
+		store_cached_model(source, input, dependencies, mdl, texture_model, sequence_groups, *cached_model);
+	if (input.sequence_groups)
+		*input.sequence_groups = std::move(sequence_groups);
+	if (input.texture_model)
+		*input.texture_model = std::move(texture_model);
+	return mdl;
 }
@@ -11,4 +11,5 @@ extern std::vector<BoneTable> g_bonetable;
 extern std::vector<Texture> g_textures;
 extern std::array<std::array<int, MAXSTUDIOSKINS>, 256> g_skinref; // [skin][skinref], returns texture index
 extern int g_skinrefcount;
-extern int g_skinfamiliescount;
\ No newline at end of file
+extern int g_skinfamiliescount;
+extern int g_sectionalign; // --align
\ No newline at end of file
@@ -1,10 +1,21 @@
 #include "cmdlib.hpp"
 
 #include <algorithm>
+#include <atomic>
 #include <cstdarg>
+#include <cstring>
 #include <iostream>
 #include <stdexcept>
 
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <process.h>
+#define getpid _getpid
+#endif
+
+#include "mappedfile.hpp"
+
 
 void error(const std::string &message)
 {
@@ -39,6 +50,51 @@ void safe_write(std::ofstream &file, const void *buffer, std::size_t count)
         error("File write failure");
 }
 
+std::filesystem::path temporary_path(const std::filesystem::path &filename)
+{
+    static std::atomic<unsigned> counter{0};
+    std::filesystem::path temp = filename;
+    temp += "." + std::to_string(getpid()) + "." + std::to_string(counter++) + ".tmp";
+    return temp;
+}
+
+void write_atomically(const std::filesystem::path &filename, const void *buffer, std::size_t count)
+{
+    const std::filesystem::path temp = temporary_path(filename);
+    try
+    {
+        std::unique_ptr<std::ofstream> file = safe_open_write(temp);
+        safe_write(*file, buffer, count);
+        file->close();
+        if (!*file)
+            error("File write failure");
+        std::filesystem::rename(temp, filename);
+    }
+    catch (...)
+    {
+        std::error_code ec;
+        std::filesystem::remove(temp, ec);
+        throw;
+    }
+}
+
+bool file_matches(const std::filesystem::path &filename, const void *buffer, std::size_t count)
+{
+    std::error_code ec;
+    if (std::filesystem::file_size(filename, ec) != count || ec)
+        return false;
+    MappedFile file;
+    return file.open(filename) && file.size() == count && (count == 0 || std::memcmp(file.data(), buffer, count) == 0);
+}
+
+bool write_if_changed(const std::filesystem::path &filename, const void *buffer, std::size_t count)
+{
+    if (file_matches(filename, buffer, count))
+        return false;
+    write_atomically(filename, buffer, count);
+    return true;
+}
+
 std::vector<char> load_file(const std::filesystem::path &filename)
 {
     std::ifstream file(filename, std::ios::binary);
@@ -46,11 +102,63 @@ std::vector<char> load_file(const std::filesystem::path &filename)
         error("Error opening " + filename.string());
 
     int length = file_length(file);
-    std::vector<char> buffer(length + 1, '\0');
+    std::vector<char> buffer(length);
     safe_read(file, buffer.data(), length);
     return buffer;
 }
 
+std::uint64_t hash_bytes(const void *data, std::size_t size, std::uint64_t seed)
+{
+    constexpr std::uint64_t m = 0xc6a4a7935bd1e995ULL;
+    constexpr int r = 47;
+
+    const std::uint8_t *bytes = static_cast<const std::uint8_t *>(data);
+    std::uint64_t h = seed ^ (size * m);
+
+    std::size_t blocks = size / 8;
+    for (std::size_t i = 0; i < blocks; i++)
+    {
+        std::uint64_t k;
+        std::memcpy(&k, bytes + i * 8, sizeof(k));
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+
+    const std::uint8_t *tail = bytes + blocks * 8;
+    switch (size & 7)
+    {
+    case 7:
+        h ^= std::uint64_t(tail[6]) << 48;
+        [[fallthrough]];
+    case 6:
+        h ^= std::uint64_t(tail[5]) << 40;
+        [[fallthrough]];
+    case 5:
+        h ^= std::uint64_t(tail[4]) << 32;
+        [[fallthrough]];
+    case 4:
+        h ^= std::uint64_t(tail[3]) << 24;
+        [[fallthrough]];
+    case 3:
+        h ^= std::uint64_t(tail[2]) << 16;
+        [[fallthrough]];
+    case 2:
+        h ^= std::uint64_t(tail[1]) << 8;
+        [[fallthrough]];
+    case 1:
+        h ^= std::uint64_t(tail[0]);
+        h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
 std::string strip_extension(const std::string &filename)
 {
     return std::filesystem::path(filename).stem().string();
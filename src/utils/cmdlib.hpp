@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <filesystem>
 #include <fstream>
 #include <memory>
@@ -11,8 +12,23 @@ void error(const std::string &message);
 std::unique_ptr<std::ofstream> safe_open_write(const std::filesystem::path &filename);
 void safe_write(std::ofstream &file, const void *buffer, std::size_t count);
 
+// Unique name next to the file to write it under before renaming it into place, so concurrent writers of the same
+// file never share a temporary file
+std::filesystem::path temporary_path(const std::filesystem::path &filename);
+// Writes under a temporary name next to the file, then renames it over the file, so readers and crashes never see
+// a partially written file
+void write_atomically(const std::filesystem::path &filename, const void *buffer, std::size_t count);
+// Whether the file exists and holds exactly these bytes
+bool file_matches(const std::filesystem::path &filename, const void *buffer, std::size_t count);
+// write_atomically, unless the file already holds these bytes: then it is left untouched, modification time included.
+// Returns whether the file was written
+bool write_if_changed(const std::filesystem::path &filename, const void *buffer, std::size_t count);
+
 std::vector<char> load_file(const std::filesystem::path &filename);
 
+// 64-bit non-cryptographic hash (MurmurHash64A), used for change detection and cache keys
+std::uint64_t hash_bytes(const void *data, std::size_t size, std::uint64_t seed = 0);
+
 // string manipulation
 std::string strip_extension(const std::string &filename);
 bool case_insensitive_compare(const std::string &str1, const std::string &str2);
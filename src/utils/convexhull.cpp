@@ -0,0 +1,206 @@
+#include "convexhull.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+// The hull is built in double precision, the float positions are exact in it
+struct HullPoint
+{
+    double x, y, z;
+};
+
+struct HullFace
+{
+    int a, b, c;      // counter-clockwise seen from outside
+    HullPoint normal; // unit length, pointing out
+    double offset;
+};
+
+static HullPoint sub(const HullPoint &p, const HullPoint &q)
+{
+    return {p.x - q.x, p.y - q.y, p.z - q.z};
+}
+
+static HullPoint cross(const HullPoint &p, const HullPoint &q)
+{
+    return {p.y * q.z - p.z * q.y, p.z * q.x - p.x * q.z, p.x * q.y - p.y * q.x};
+}
+
+static double dot(const HullPoint &p, const HullPoint &q)
+{
+    return p.x * q.x + p.y * q.y + p.z * q.z;
+}
+
+static double length(const HullPoint &p)
+{
+    return std::sqrt(dot(p, p));
+}
+
+static HullFace make_face(const std::vector<HullPoint> &points, int a, int b, int c)
+{
+    HullFace face{a, b, c, {}, 0.0};
+    face.normal = cross(sub(points[b], points[a]), sub(points[c], points[a]));
+    const double len = length(face.normal);
+    if (len > 0.0)
+    {
+        face.normal = {face.normal.x / len, face.normal.y / len, face.normal.z / len};
+    }
+    face.offset = dot(face.normal, points[a]);
+    return face;
+}
+
+// Distance of p above the plane of face, negative below
+static double height(const HullFace &face, const HullPoint &p)
+{
+    return dot(face.normal, p) - face.offset;
+}
+
+bool convex_hull_vertices(const std::vector<Vector3> &vertices, std::vector<int> &hull, double &tolerance)
+{
+    hull.clear();
+    tolerance = 0.0;
+    if (vertices.size() < 4)
+        return false;
+
+    std::vector<HullPoint> points;
+    double extent = 0.0;
+    for (const auto &v : vertices)
+    {
+        points.push_back({v.x, v.y, v.z});
+        extent = std::max({extent, std::fabs(double{v.x}), std::fabs(double{v.y}), std::fabs(double{v.z})});
+    }
+    // points closer than this to a face are treated as lying on it
+    const double epsilon = 1e-9 * std::max(extent, 1.0);
+
+    // starting tetrahedron: two far apart points, the point farthest from their line and the point farthest from that plane
+    int i0 = 0;
+    for (int i = 1; i < points.size(); i++)
+    {
+        if (points[i].x < points[i0].x)
+            i0 = i;
+    }
+    int i1 = i0;
+    double best = 0.0;
+    for (int i = 0; i < points.size(); i++)
+    {
+        const double d = length(sub(points[i], points[i0]));
+        if (d > best)
+        {
+            best = d;
+            i1 = i;
+        }
+    }
+    if (best <= epsilon)
+        return false;
+
+    int i2 = i0;
+    best = 0.0;
+    const HullPoint axis = sub(points[i1], points[i0]);
+    for (int i = 0; i < points.size(); i++)
+    {
+        const double d = length(cross(axis, sub(points[i], points[i0]))) / length(axis);
+        if (d > best)
+        {
+            best = d;
+            i2 = i;
+        }
+    }
+    if (best <= epsilon)
+        return false;
+
+    int i3 = i0;
+    best = 0.0;
+    const HullFace base = make_face(points, i0, i1, i2);
+    for (int i = 0; i < points.size(); i++)
+    {
+        const double d = std::fabs(height(base, points[i]));
+        if (d > best)
+        {
+            best = d;
+            i3 = i;
+        }
+    }
+    if (best <= epsilon)
+        return false;
+
+    std::vector<HullFace> faces;
+    const HullPoint center{(points[i0].x + points[i1].x + points[i2].x + points[i3].x) / 4,
+                           (points[i0].y + points[i1].y + points[i2].y + points[i3].y) / 4,
+                           (points[i0].z + points[i1].z + points[i2].z + points[i3].z) / 4};
+    const int start[4][3] = {{i0, i1, i2}, {i0, i3, i1}, {i1, i3, i2}, {i2, i3, i0}};
+    for (const auto &f : start)
+    {
+        HullFace face = make_face(points, f[0], f[1], f[2]);
+        if (height(face, center) > 0.0)
+            face = make_face(points, f[0], f[2], f[1]);
+        faces.push_back(face);
+    }
+
+    // add the points one at a time, replacing the faces each one sees by a cone from the horizon to the point.
+    // Far points go first, so most of the later ones are already inside
+    std::vector<int> order;
+    std::vector<double> distance(points.size());
+    for (int i = 0; i < points.size(); i++)
+    {
+        distance[i] = length(sub(points[i], center));
+        if (i != i0 && i != i1 && i != i2 && i != i3)
+            order.push_back(i);
+    }
+    std::sort(order.begin(), order.end(), [&distance](int a, int b)
+              { return distance[a] > distance[b]; });
+
+    std::vector<std::pair<int, int>> edges;
+    for (int i : order)
+    {
+        // remove the visible faces, keeping their edges
+        edges.clear();
+        for (int f = 0; f < faces.size();)
+        {
+            if (height(faces[f], points[i]) > epsilon)
+            {
+                edges.emplace_back(faces[f].a, faces[f].b);
+                edges.emplace_back(faces[f].b, faces[f].c);
+                edges.emplace_back(faces[f].c, faces[f].a);
+                faces[f] = faces.back();
+                faces.pop_back();
+            }
+            else
+            {
+                f++;
+            }
+        }
+
+        // horizon edges belong to exactly one visible face, their winding is kept for the new faces
+        for (const auto &edge : edges)
+        {
+            if (std::find(edges.begin(), edges.end(), std::make_pair(edge.second, edge.first)) == edges.end())
+                faces.push_back(make_face(points, edge.first, edge.second, i));
+        }
+    }
+
+    // every point has to be inside every face, or the hull is not usable
+    double outside = 0.0;
+    for (const auto &p : points)
+    {
+        for (const auto &face : faces)
+        {
+            outside = std::max(outside, height(face, p));
+        }
+    }
+    if (outside > 1e-6 * std::max(extent, 1.0))
+        return false;
+    tolerance = 4.0 * (outside + epsilon);
+
+    std::vector<char> used(points.size(), 0);
+    for (const auto &face : faces)
+    {
+        used[face.a] = used[face.b] = used[face.c] = 1;
+    }
+    for (int i = 0; i < points.size(); i++)
+    {
+        if (used[i])
+            hull.push_back(i);
+    }
+    return true;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <vector>
+
+#include "utils/mathlib.hpp"
+
+// Finds the vertices of the convex hull of points, returning false if the points are (nearly) flat.
+// tolerance is set to how far any of the points may lie outside the hull because of rounding
+bool convex_hull_vertices(const std::vector<Vector3> &points, std::vector<int> &hull, double &tolerance);
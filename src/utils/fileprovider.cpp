@@ -0,0 +1,147 @@
+#include "fileprovider.hpp"
+
+#include <algorithm>
+
+#include "cmdlib.hpp"
+
+static DiskFileProvider g_diskfileprovider;
+FileProvider *g_fileprovider = &g_diskfileprovider;
+
+static std::string provider_key(const std::filesystem::path &path)
+{
+    return path.lexically_normal().generic_string();
+}
+
+void FileProvider::map(const std::filesystem::path &path, MappedFile &file)
+{
+    file.assign(load(path));
+}
+
+bool DiskFileProvider::exists(const std::filesystem::path &path)
+{
+    return std::filesystem::exists(path);
+}
+
+std::vector<char> DiskFileProvider::load(const std::filesystem::path &path)
+{
+    return load_file(path);
+}
+
+void DiskFileProvider::map(const std::filesystem::path &path, MappedFile &file)
+{
+    if (!file.open(path))
+        error("Error opening " + path.string());
+}
+
+bool CachedDiskFileProvider::exists(const std::filesystem::path &path)
+{
+    return std::filesystem::exists(path);
+}
+
+std::vector<char> CachedDiskFileProvider::load(const std::filesystem::path &path)
+{
+    std::error_code ec;
+    const auto mtime = std::filesystem::last_write_time(path, ec);
+    const auto size = std::filesystem::file_size(path, ec);
+    if (ec)
+        error("Error opening " + path.string());
+
+    Entry &entry = files[provider_key(path)];
+    entry.last_use = ++uses;
+    if (entry.mtime == mtime && entry.size == size && entry.data.size() == size)
+    {
+        hits++;
+        return entry.data;
+    }
+
+    misses++;
+    total -= entry.data.size();
+    entry.data = load_file(path);
+    entry.mtime = mtime;
+    entry.size = size;
+    total += entry.data.size();
+    std::vector<char> data = entry.data;
+    evict();
+    return data;
+}
+
+void CachedDiskFileProvider::prune()
+{
+    for (auto it = files.begin(); it != files.end();)
+    {
+        std::error_code ec;
+        if (std::filesystem::exists(it->first, ec))
+        {
+            ++it;
+            continue;
+        }
+        total -= it->second.data.size();
+        it = files.erase(it);
+    }
+}
+
+// Drops the least recently loaded files until the contents fit in max_size again
+void CachedDiskFileProvider::evict()
+{
+    while (total > max_size && !files.empty())
+    {
+        auto oldest = files.begin();
+        for (auto it = files.begin(); it != files.end(); ++it)
+        {
+            if (it->second.last_use < oldest->second.last_use)
+                oldest = it;
+        }
+        total -= oldest->second.data.size();
+        files.erase(oldest);
+    }
+}
+
+bool RecordingFileProvider::exists(const std::filesystem::path &path)
+{
+    const bool found = source.exists(path);
+    if (!found && missing)
+        record(*missing, path);
+    return found;
+}
+
+std::vector<char> RecordingFileProvider::load(const std::filesystem::path &path)
+{
+    if (missing && !source.exists(path))
+        record(*missing, path);
+    std::vector<char> data = source.load(path);
+    record(loaded, path);
+    return data;
+}
+
+void RecordingFileProvider::map(const std::filesystem::path &path, MappedFile &file)
+{
+    if (missing && !source.exists(path))
+        record(*missing, path);
+    source.map(path, file);
+    record(loaded, path);
+}
+
+void RecordingFileProvider::record(std::vector<std::filesystem::path> &paths, const std::filesystem::path &path)
+{
+    const std::filesystem::path normalized = path.lexically_normal();
+    if (std::find(paths.begin(), paths.end(), normalized) == paths.end())
+        paths.push_back(normalized);
+}
+
+void MemoryFileProvider::add(const std::filesystem::path &path, std::vector<char> data)
+{
+    files[provider_key(path)] = std::move(data);
+}
+
+bool MemoryFileProvider::exists(const std::filesystem::path &path)
+{
+    return files.find(provider_key(path)) != files.end();
+}
+
+std::vector<char> MemoryFileProvider::load(const std::filesystem::path &path)
+{
+    auto it = files.find(provider_key(path));
+    if (it == files.end())
+        error("Error opening " + path.string());
+    return it->second;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "mappedfile.hpp"
+
+// Source of every file the compiler reads (QC, SMD, BMP).
+// Lets the compiler run against the disk or against in-memory buffers.
+class FileProvider
+{
+public:
+    virtual ~FileProvider() = default;
+
+    virtual bool exists(const std::filesystem::path &path) = 0;
+    // Returns the file contents, calls error() if the file can't be read
+    virtual std::vector<char> load(const std::filesystem::path &path) = 0;
+    // Like load, but maps the file in place where the provider reads straight from disk
+    virtual void map(const std::filesystem::path &path, MappedFile &file);
+};
+
+class DiskFileProvider : public FileProvider
+{
+public:
+    bool exists(const std::filesystem::path &path) override;
+    std::vector<char> load(const std::filesystem::path &path) override;
+    void map(const std::filesystem::path &path, MappedFile &file) override;
+};
+
+// Files are looked up by their lexically normalized path
+class MemoryFileProvider : public FileProvider
+{
+public:
+    void add(const std::filesystem::path &path, std::vector<char> data);
+
+    bool exists(const std::filesystem::path &path) override;
+    std::vector<char> load(const std::filesystem::path &path) override;
+
+private:
+    std::unordered_map<std::string, std::vector<char>> files;
+};
+
+// Reads from disk, keeping file contents in memory between compiles.
+// A file is read again only when its size or modification time changes.
+class CachedDiskFileProvider : public FileProvider
+{
+public:
+    // Keeps at most max_size bytes of file contents, the least recently loaded files are dropped first
+    explicit CachedDiskFileProvider(std::uintmax_t max_size = 256 * 1024 * 1024) : max_size(max_size) {}
+
+    bool exists(const std::filesystem::path &path) override;
+    std::vector<char> load(const std::filesystem::path &path) override;
+    // Drops the files that no longer exist
+    void prune();
+
+    int hits = 0;
+    int misses = 0;
+
+private:
+    struct Entry
+    {
+        std::filesystem::file_time_type mtime;
+        std::uintmax_t size;
+        std::vector<char> data;
+        std::uint64_t last_use = 0;
+    };
+    void evict();
+
+    std::unordered_map<std::string, Entry> files;
+    std::uintmax_t max_size;
+    std::uintmax_t total = 0; // bytes of data held by files
+    std::uint64_t uses = 0;
+};
+
+// Forwards to another provider and records the path of every file loaded through it, and of every file looked up
+// but not found if missing is set
+class RecordingFileProvider : public FileProvider
+{
+public:
+    RecordingFileProvider(FileProvider &source, std::vector<std::filesystem::path> &loaded,
+                          std::vector<std::filesystem::path> *missing = nullptr)
+        : source(source), loaded(loaded), missing(missing) {}
+
+    bool exists(const std::filesystem::path &path) override;
+    std::vector<char> load(const std::filesystem::path &path) override;
+    void map(const std::filesystem::path &path, MappedFile &file) override;
+
+private:
+    static void record(std::vector<std::filesystem::path> &paths, const std::filesystem::path &path);
+
+    FileProvider &source;
+    std::vector<std::filesystem::path> &loaded;
+    std::vector<std::filesystem::path> *missing;
+};
+
+extern FileProvider *g_fileprovider;
@@ -0,0 +1,77 @@
+#include "mappedfile.hpp"
+
+#include <fstream>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::open(const std::filesystem::path &path)
+{
+    close();
+#ifndef _WIN32
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        ::close(fd);
+        return false;
+    }
+    length = static_cast<std::size_t>(st.st_size);
+    if (length > 0)
+    {
+        void *view = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (view != MAP_FAILED)
+        {
+            bytes = static_cast<const std::byte *>(view);
+            mapped = true;
+        }
+    }
+    ::close(fd);
+    if (mapped || length == 0)
+        return true;
+#endif
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file)
+        return false;
+    buffer.resize(static_cast<std::size_t>(file.tellg()));
+    file.seekg(0);
+    if (!file.read(buffer.data(), buffer.size()))
+    {
+        buffer.clear();
+        return false;
+    }
+    bytes = reinterpret_cast<const std::byte *>(buffer.data());
+    length = buffer.size();
+    return true;
+}
+
+void MappedFile::assign(std::vector<char> contents)
+{
+    close();
+    buffer = std::move(contents);
+    bytes = reinterpret_cast<const std::byte *>(buffer.data());
+    length = buffer.size();
+}
+
+void MappedFile::close()
+{
+#ifndef _WIN32
+    if (mapped)
+        munmap(const_cast<std::byte *>(bytes), length);
+#endif
+    mapped = false;
+    bytes = nullptr;
+    length = 0;
+    buffer.clear();
+}
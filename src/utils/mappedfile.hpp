@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <vector>
+
+// Read-only view of a whole file, memory mapped where the platform supports it
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    ~MappedFile();
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    // Returns false if the file can't be opened
+    bool open(const std::filesystem::path &path);
+    // Holds contents that were already loaded, for files that don't come from disk
+    void assign(std::vector<char> contents);
+    void close();
+
+    const std::byte *data() const { return bytes; }
+    std::size_t size() const { return length; }
+
+private:
+    const std::byte *bytes = nullptr;
+    std::size_t length = 0;
+    bool mapped = false;
+    std::vector<char> buffer; // contents when the file is not mapped
+};
@@ -0,0 +1,47 @@
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <thread>
+#include <vector>
+
+void parallel_for(int count, const std::function<void(int)> &task)
+{
+    const int numworkers = std::min(count, static_cast<int>(std::max(1u, std::thread::hardware_concurrency())));
+    std::vector<std::exception_ptr> errors(count > 0 ? count : 0);
+    std::atomic<int> next{0};
+
+    auto worker = [&]()
+    {
+        for (int i = next++; i < count; i = next++)
+        {
+            try
+            {
+                task(i);
+            }
+            catch (...)
+            {
+                errors[i] = std::current_exception();
+            }
+        }
+    };
+
+    // the calling thread is one of the workers
+    std::vector<std::thread> threads;
+    for (int i = 1; i < numworkers; i++)
+    {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+
+    for (auto &error : errors)
+    {
+        if (error)
+            std::rethrow_exception(error);
+    }
+}
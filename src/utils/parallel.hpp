@@ -0,0 +1,7 @@
+#pragma once
+
+#include <functional>
+
+// Runs task(0) ... task(count - 1) on a pool of worker threads, one per hardware thread, and waits for all of them.
+// If tasks throw, the exception of the lowest failing index is rethrown once every task has finished
+void parallel_for(int count, const std::function<void(int)> &task);
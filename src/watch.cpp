@@ -0,0 +1,180 @@
+// watch.cpp: recompile a model when its inputs change (inotify)
+
+#include "watch.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iterator>
+#include <map>
+#include <set>
+
+#include "compile.hpp"
+#include "utils/cmdlib.hpp"
+#include "utils/fileprovider.hpp"
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+constexpr int WATCH_DEBOUNCE_MS = 150; // changes closer than this are compiled together
+
+// Reads pending inotify events, adding the changed paths to changed
+static void read_events(int fd, const std::map<int, std::filesystem::path> &watches, std::set<std::filesystem::path> &changed)
+{
+	alignas(inotify_event) char buffer[16 * 1024];
+	ssize_t length = read(fd, buffer, sizeof(buffer));
+	for (char *p = buffer; p < buffer + length;)
+	{
+		const inotify_event *event = reinterpret_cast<const inotify_event *>(p);
+		auto it = watches.find(event->wd);
+		if (it != watches.end() && event->len > 0)
+		{
+			changed.insert((it->second / event->name).lexically_normal());
+		}
+		p += sizeof(inotify_event) + event->len;
+	}
+}
+
+// Describes what the changed files will cause to be redone
+static void print_changes(const std::set<std::filesystem::path> &changed, const std::filesystem::path &qc_path, const CompileCache &cache)
+{
+	std::set<std::string> animations;
+	for (const auto &entry : cache.animations)
+	{
+		animations.insert(entry.first.substr(0, entry.first.find('|')));
+	}
+
+	printf("\n=====================\n");
+	for (const auto &path : changed)
+	{
+		const char *kind;
+		if (path == qc_path)
+			kind = "QC, full rebuild";
+		else if (case_insensitive_compare(path.extension().string(), ".bmp") ||
+				 case_insensitive_compare(path.extension().string(), ".tga"))
+			kind = "texture";
+		else if (animations.count(path.generic_string()))
+			kind = "sequence animation";
+		else
+			kind = "reference";
+		printf("Changed %s (%s)\n", path.string().c_str(), kind);
+	}
+}
+
+void run_watch(const Options &watch_options)
+{
+	Options options = watch_options;
+	options.input.qc_path = std::filesystem::absolute(options.input.qc_path).lexically_normal();
+
+	// unchanged inputs are reused from memory, only changed files are read and parsed again
+	CachedDiskFileProvider files;
+	CompileCache cache;
+	std::vector<std::filesystem::path> dependencies;
+	std::vector<std::filesystem::path> missing;
+	options.input.files = &files;
+	options.input.cache = &cache;
+	options.input.dependencies = &dependencies;
+	options.input.missing = &missing;
+
+	int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if (fd < 0)
+	{
+		error("Cannot initialize inotify");
+	}
+
+	// directories are watched instead of files, so editors that save by renaming are still seen
+	std::map<int, std::filesystem::path> watches;
+	std::set<std::filesystem::path> watched_dirs;
+	std::set<std::filesystem::path> inputs;
+	bool failed = false;
+
+	const auto watch_dir = [&](const std::filesystem::path &dir)
+	{
+		if (watched_dirs.insert(dir).second)
+		{
+			int wd = inotify_add_watch(fd, dir.string().c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE);
+			if (wd >= 0)
+				watches[wd] = dir;
+		}
+	};
+
+	auto rebuild = [&]()
+	{
+		dependencies.clear();
+		missing.clear();
+		const auto start = std::chrono::steady_clock::now();
+		try
+		{
+			run_compile(options);
+			failed = false;
+			const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+			printf("Compiled in %d ms\n", static_cast<int>(elapsed.count()));
+		}
+		catch (const std::exception &e)
+		{
+			printf("%s\n", e.what());
+			failed = true;
+		}
+
+		dependencies.push_back(options.input.qc_path);
+		inputs.clear();
+		for (const auto &path : dependencies)
+		{
+			inputs.insert(path.lexically_normal());
+			watch_dir(path.parent_path().lexically_normal());
+		}
+		// files that weren't found are inputs too, their directory may not exist yet: then the path created in its
+		// nearest existing ancestor is, and the rebuild it triggers watches the new directory
+		for (const auto &path : missing)
+		{
+			std::filesystem::path created = std::filesystem::absolute(path).lexically_normal();
+			std::error_code ec;
+			while (created.has_parent_path() && created.parent_path() != created && !std::filesystem::is_directory(created.parent_path(), ec))
+				created = created.parent_path();
+			inputs.insert(created);
+			watch_dir(created.parent_path());
+		}
+		printf("Watching %zu files for changes\n", inputs.size());
+		fflush(stdout);
+	};
+
+	rebuild();
+
+	pollfd pfd{fd, POLLIN, 0};
+	while (true)
+	{
+		std::set<std::filesystem::path> changed;
+		if (poll(&pfd, 1, -1) <= 0)
+			continue;
+		read_events(fd, watches, changed);
+
+		// debounce: keep collecting until the files have been quiet for a while
+		while (poll(&pfd, 1, WATCH_DEBOUNCE_MS) > 0)
+		{
+			read_events(fd, watches, changed);
+		}
+
+		// after a failed compile any change in a watched directory may fix it (e.g. a missing SMD)
+		if (!failed)
+		{
+			for (auto it = changed.begin(); it != changed.end();)
+				it = inputs.count(*it) ? std::next(it) : changed.erase(it);
+		}
+		if (changed.empty())
+			continue;
+
+		print_changes(changed, options.input.qc_path, cache);
+		rebuild();
+	}
+}
+
+#else
+
+void run_watch(const Options &options)
+{
+	error("--watch is only supported on Linux");
+}
+
+#endif
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "driver.hpp"
+
+// Compiles the model, then recompiles it whenever the QC or a file it reads changes.
+// Runs until the process is killed.
+void run_watch(const Options &options);
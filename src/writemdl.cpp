@@ -1,6 +1,10 @@
 #include "writemdl.hpp"
 
+#include <cstdio>
 #include <cstring>
+#include <string>
+#include <unordered_map>
+#include <utility>
 
 #include "format/mdl.hpp"
 #include "format/qc.hpp"
@@ -9,18 +13,54 @@
 #include "utils/stripification.hpp"
 #include "utils/cmdlib.hpp"
 
-constexpr int FILEBUFFER = 16 * 1024 * 1024;
 extern int g_numcommandnodes;
 
 std::uint8_t *g_currentposition;
 std::uint8_t *g_bufferstart;
+static std::uint8_t *g_bufferend;
 
 #define ALIGN(a) (((uintptr_t)(a) + 3) & ~(uintptr_t)3)
 
+static std::size_t g_alignpadding; // bytes added by align_section beyond the usual 4 byte alignment
+
+// Start of a section SIMD code reads in place: the position, already 4 byte aligned, rounded up to --align bytes
+// from the start of the file. Offsets are all the file format stores, so the result is still a valid model
+static std::uint8_t *align_section(std::uint8_t *position, const std::uint8_t *start)
+{
+	const std::size_t offset = position - start;
+	const std::size_t padding = (g_sectionalign - offset % g_sectionalign) % g_sectionalign;
+	g_alignpadding += padding;
+	return position + padding;
+}
+
+// Most bytes align_section adds to a section
+static std::size_t section_padding()
+{
+	return g_sectionalign - 4;
+}
+
+// <model>NN, the name of a sequence group file without its directory and extension
+static std::string sequence_group_base_name(const QC &qc, int group)
+{
+	const std::string model = strip_extension(qc.modelname);
+	char number[16];
+	std::snprintf(number, sizeof(number), "%02d", group);
+	return model.substr(model.find_last_of("/\\") + 1) + number;
+}
+
+// Path the engine loads a sequence group from, the file itself is written next to the model
+static std::string sequence_group_file(const QC &qc, int group)
+{
+	const std::string file = "models\\" + sequence_group_base_name(qc, group) + ".mdl";
+	if (file.size() >= sizeof(StudioSequenceGroup::name))
+		error("Sequence group file name " + file + " is too long");
+	return file;
+}
 
 static void write_bone_info(StudioHeader *header, QC &qc)
 {
 	// save bone info
+	g_currentposition = align_section(g_currentposition, g_bufferstart);
 	StudioBone *pbone = (StudioBone *)g_currentposition;
 	header->numbones = g_bonetable.size();
 	header->boneindex = static_cast<int>(g_currentposition - g_bufferstart);
@@ -182,7 +222,7 @@ static void write_sequence_info(StudioHeader *header, QC &qc, int &frames, float
 			{
 				pevent[j].frame = qc.sequences[i].events[j].frame - qc.sequences[i].frameoffset;
 				pevent[j].event = qc.sequences[i].events[j].event;
-				memcpy(pevent[j].options, qc.sequences[i].events[j].options.c_str(), sizeof(pevent[j].options));
+				std::strncpy(pevent[j].options, qc.sequences[i].events[j].options.c_str(), sizeof(pevent[j].options) - 1);
 			}
 			g_currentposition = (std::uint8_t *)ALIGN(g_currentposition);
 		}
@@ -190,12 +230,16 @@ static void write_sequence_info(StudioHeader *header, QC &qc, int &frames, float
 
 	// save sequence group info
 	StudioSequenceGroup *pseqgroup = (StudioSequenceGroup *)g_currentposition;
-	header->numseqgroups = 1; // 1 since $sequencegroup is deprecated
+	header->numseqgroups = qc.sequencegroups.size();
 	header->seqgroupindex = static_cast<int>(g_currentposition - g_bufferstart);
 	g_currentposition += header->numseqgroups * sizeof(StudioSequenceGroup);
 	g_currentposition = (std::uint8_t *)ALIGN(g_currentposition);
-	std::strcpy(pseqgroup[0].label, "default");
-	std::strcpy(pseqgroup[0].name, "");
+	for (int i = 0; i < qc.sequencegroups.size(); i++)
+	{
+		std::strncpy(pseqgroup[i].label, qc.sequencegroups[i].c_str(), sizeof(pseqgroup[i].label) - 1);
+		if (i > 0)
+			std::strcpy(pseqgroup[i].name, sequence_group_file(qc, i).c_str());
+	}
 
 	// save transition graph
 	std::uint8_t *ptransition = (std::uint8_t *)g_currentposition;
@@ -212,41 +256,143 @@ static void write_sequence_info(StudioHeader *header, QC &qc, int &frames, float
 	}
 }
 
-static std::uint8_t *write_animations(QC &qc, std::uint8_t *pData, const std::uint8_t *pStart, int group)
+// Values of one bone/DOF channel, as written to the file
+static std::string animation_channel_key(const Animation &anim, int bone, int dof)
+{
+	return std::string((const char *)anim.anims[bone][dof], anim.numanim[bone][dof] * sizeof(StudioAnimationValue));
+}
+
+// Every channel of every blend of the sequence, sequences with equal keys can share their animation data
+static std::string sequence_animation_key(const Sequence &sequence)
+{
+	std::string key = std::to_string(sequence.anims.size()) + ':';
+	for (auto &anim : sequence.anims)
+	{
+		for (int j = 0; j < g_bonetable.size(); j++)
+		{
+			for (int k = 0; k < DEGREESOFFREEDOM; k++)
+			{
+				key.append((const char *)&anim.numanim[j][k], sizeof(anim.numanim[j][k]));
+				key += animation_channel_key(anim, j, k);
+			}
+		}
+	}
+	return key;
+}
+
+// Bytes write_animations takes for the sequence when none of its channels are shared, at most
+static std::size_t sequence_animation_size(const Sequence &sequence)
+{
+	std::size_t size = ALIGN(sequence.anims.size() * g_bonetable.size() * sizeof(StudioAnimationFrameOffset));
+	for (auto &anim : sequence.anims)
+	{
+		for (int j = 0; j < g_bonetable.size(); j++)
+		{
+			for (int k = 0; k < DEGREESOFFREEDOM; k++)
+			{
+				size += anim.numanim[j][k] * sizeof(StudioAnimationValue);
+			}
+		}
+	}
+	return ALIGN(size) + section_padding();
+}
+
+// Moves the sequences of the default group that don't fit in $sequencegroupsize to new groups, in order
+static void split_sequence_groups(QC &qc)
+{
+	if (qc.sequencegroupsize <= 0)
+		return;
+
+	int group = 0;
+	std::size_t groupsize = 0;
+	for (auto &sequence : qc.sequences)
+	{
+		if (sequence.seqgroup != 0)
+			continue;
+		const std::size_t size = sequence_animation_size(sequence);
+		if (groupsize > 0 && groupsize + size > static_cast<std::size_t>(qc.sequencegroupsize))
+		{
+			if (qc.sequencegroups.size() >= MAXSTUDIOGROUPS)
+				error("Too many sequence groups (max " + std::to_string(MAXSTUDIOGROUPS) + "), raise the sequence group size");
+			group = static_cast<int>(qc.sequencegroups.size());
+			qc.sequencegroups.push_back(sequence_group_base_name(qc, group));
+			groupsize = 0;
+		}
+		sequence.seqgroup = group;
+		groupsize += size;
+	}
+}
+
+// The buffer sizes are upper bounds computed before writing, running past them is a bug in the sizing.
+// Checked before every variable-size write so the error comes before the overrun
+static void check_buffer_space(const std::uint8_t *position, const std::uint8_t *end, std::size_t bytes)
+{
+	if (position > end || bytes > static_cast<std::size_t>(end - position))
+		error("Model data exceeds its computed size\n");
+}
+
+static std::uint8_t *write_animations(QC &qc, std::uint8_t *pData, const std::uint8_t *pStart, const std::uint8_t *pEnd, int group)
 {
 	// hack for seqgroup 0
 	// pseqgroup->data = (pData - pStart);
 
+	// identical sequences share one copy of their animations, identical channels of a sequence (across bones and
+	// blends) share one value run; offsets are unsigned and relative to the bone, so runs can't be shared across sequences
+	std::unordered_map<std::string, std::pair<int, std::size_t>> written_sequences; // animindex and size by sequence_animation_key
+	int shared_sequences = 0;
+	int shared_channels = 0;
+	std::size_t saved = 0;
+
 	for (int i = 0; i < qc.sequences.size(); i++)
 	{
 		if (qc.sequences[i].seqgroup == group)
 		{
+			const std::string sequence_key = sequence_animation_key(qc.sequences[i]);
+			auto written = written_sequences.find(sequence_key);
+			if (written != written_sequences.end())
+			{
+				qc.sequences[i].animindex = written->second.first;
+				shared_sequences++;
+				saved += written->second.second;
+				continue;
+			}
+
 			// save animations
+			check_buffer_space(pData, pEnd, sequence_animation_size(qc.sequences[i]));
+			pData = align_section(pData, pStart);
 			StudioAnimationFrameOffset *panim = (StudioAnimationFrameOffset *)pData;
 			qc.sequences[i].animindex = static_cast<int>(pData - pStart);
 			pData += qc.sequences[i].anims.size() * g_bonetable.size() * sizeof(StudioAnimationFrameOffset);
 			pData = (std::uint8_t *)ALIGN(pData);
 
+			std::unordered_map<std::string, std::uint8_t *> written_channels; // value run by animation_channel_key
 			StudioAnimationValue *panimvalue = (StudioAnimationValue *)pData;
 			for (int blends = 0; blends < qc.sequences[i].anims.size(); blends++)
 			{
+				const Animation &anim = qc.sequences[i].anims[blends];
 				// save animation value info
 				for (int j = 0; j < g_bonetable.size(); j++)
 				{
 					for (int k = 0; k < DEGREESOFFREEDOM; k++)
 					{
-						if (qc.sequences[i].anims[blends].numanim[j][k] == 0)
+						if (anim.numanim[j][k] == 0)
 						{
 							panim->offset[k] = 0;
+							continue;
+						}
+						auto channel = written_channels.emplace(animation_channel_key(anim, j, k), (std::uint8_t *)panimvalue);
+						if (!channel.second)
+						{
+							panim->offset[k] = static_cast<std::uint16_t>(channel.first->second - (std::uint8_t *)panim);
+							shared_channels++;
+							saved += anim.numanim[j][k] * sizeof(StudioAnimationValue);
+							continue;
 						}
-						else
+						panim->offset[k] = static_cast<std::uint16_t>((std::uint8_t *)panimvalue - (std::uint8_t *)panim);
+						for (int n = 0; n < anim.numanim[j][k]; n++)
 						{
-							panim->offset[k] = static_cast<std::uint16_t>((std::uint8_t *)panimvalue - (std::uint8_t *)panim);
-							for (int n = 0; n < qc.sequences[i].anims[blends].numanim[j][k]; n++)
-							{
-								panimvalue->value = qc.sequences[i].anims[blends].anims[j][k][n].value;
-								panimvalue++;
-							}
+							panimvalue->value = anim.anims[j][k][n].value;
+							panimvalue++;
 						}
 					}
 					if (((std::uint8_t *)panimvalue - (std::uint8_t *)panim) > 65535)
@@ -258,13 +404,73 @@ static std::uint8_t *write_animations(QC &qc, std::uint8_t *pData, const std::ui
 			// printf("raw bone data %d : %s\n", (std::uint8_t *)panimvalue - pData, sequence[i].name);
 			pData = (std::uint8_t *)panimvalue;
 			pData = (std::uint8_t *)ALIGN(pData);
+			written_sequences.emplace(sequence_key, std::make_pair(qc.sequences[i].animindex, pData - pStart - qc.sequences[i].animindex));
 		}
 	}
+
+	if (shared_channels || shared_sequences)
+	{
+		printf("shared    %d animation channels, %d sequences (%zu bytes saved)\n", shared_channels, shared_sequences, saved);
+	}
 	return pData;
 }
 
+// Bytes write_textures writes
+static std::size_t textures_size()
+{
+	std::size_t size = ALIGN(g_textures.size() * sizeof(StudioTexture));
+	size += ALIGN(g_skinfamiliescount * g_skinrefcount * sizeof(short));
+	for (auto &texture : g_textures)
+	{
+		size += texture.size;
+	}
+	return ALIGN(size);
+}
+
+// Bytes write_mdl writes to the model file, computed before anything is written so the buffer is allocated once.
+// Exact except for animations shared between sequences and the triangle commands, bounded by one strip per triangle
+static std::size_t model_size(const QC &qc)
+{
+	std::size_t size = sizeof(StudioHeader);
+
+	size += section_padding() + ALIGN(g_bonetable.size() * sizeof(StudioBone));
+	size += ALIGN(qc.bonecontrollers.size() * sizeof(StudioBoneController));
+	size += ALIGN(qc.attachments.size() * sizeof(StudioAttachment));
+	size += ALIGN(qc.hitboxes.size() * sizeof(StudioHitbox));
+
+	size += qc.sequences.size() * sizeof(StudioSequenceDescription);
+	for (auto &sequence : qc.sequences)
+	{
+		if (sequence.seqgroup == 0)
+			size += sequence_animation_size(sequence);
+		size += ALIGN(sequence.events.size() * sizeof(StudioAnimationEvent));
+	}
+	size += ALIGN(qc.sequencegroups.size() * sizeof(StudioSequenceGroup));
+	size += ALIGN(g_numxnodes * g_numxnodes * sizeof(std::uint8_t));
+
+	size += ALIGN(qc.bodyparts.size() * sizeof(StudioBodyPart) + qc.submodels.size() * sizeof(StudioModel));
+	for (auto *submodel : qc.submodels)
+	{
+		size += ALIGN(submodel->verts.size()) + ALIGN(submodel->normals.size());
+		size += ALIGN(submodel->verts.size() * sizeof(Vector3)) + ALIGN(submodel->normals.size() * sizeof(Vector3));
+		size += section_padding() * 2;
+		size += ALIGN(submodel->nummesh * sizeof(StudioMesh));
+		for (int j = 0; j < submodel->nummesh; j++)
+		{
+			// a count and four shorts per vertex for every strip of at least one triangle, and the end marker
+			size += ALIGN((submodel->pmeshes[j]->numtris * 13 + 1) * sizeof(short));
+		}
+	}
+
+	if (!qc.externaltextures)
+		size += textures_size();
+	return size;
+}
+
 static void write_textures(StudioHeader *header)
 {
+	check_buffer_space(g_currentposition, g_bufferend, textures_size());
+
 	// save bone info
 	StudioTexture *ptexture = (StudioTexture *)g_currentposition;
 	header->numtextures = g_textures.size();
@@ -303,6 +509,32 @@ static void write_textures(StudioHeader *header)
 	g_currentposition = (std::uint8_t *)ALIGN(g_currentposition);
 }
 
+// Writes the textures to <model>T.mdl, a model header with only its texture and skin fields set
+static std::vector<std::byte> write_texture_model(const std::string &file_name)
+{
+	std::uint8_t *modelstart = g_bufferstart;
+	std::uint8_t *modelposition = g_currentposition;
+	std::uint8_t *modelend = g_bufferend;
+	std::vector<std::byte> data(sizeof(StudioHeader) + textures_size());
+	g_bufferstart = (std::uint8_t *)data.data();
+	g_bufferend = g_bufferstart + data.size();
+
+	StudioHeader *textureheader = (StudioHeader *)g_bufferstart;
+	textureheader->ident = IDSTUDIOHEADER;
+	textureheader->version = STUDIO_VERSION;
+	std::strncpy(textureheader->name, file_name.c_str(), sizeof(textureheader->name) - 1);
+
+	g_currentposition = (std::uint8_t *)textureheader + sizeof(StudioHeader);
+	write_textures(textureheader);
+	textureheader->length = static_cast<int>(g_currentposition - g_bufferstart);
+
+	data.resize(textureheader->length);
+	g_bufferstart = modelstart;
+	g_currentposition = modelposition;
+	g_bufferend = modelend;
+	return data;
+}
+
 static void write_model(StudioHeader *header, QC &qc)
 {
 	StudioBodyPart *pbodypart = (StudioBodyPart *)g_currentposition;
@@ -328,28 +560,52 @@ static void write_model(StudioHeader *header, QC &qc)
 	{
 		int normmap[MAXSTUDIOVERTS];
 		int normimap[MAXSTUDIOVERTS];
-		int n = 0;
 
 		std::strcpy(pmodel[i].name, qc.submodels[i]->name.c_str());
 
 		// save bbox info
 
-		// remap normals to be sorted by skin reference
+		// remap normals to be sorted by skin reference, in mesh order: a counting sort with one bucket per mesh
+		const std::vector<Normal> &normals = qc.submodels[i]->normals;
+		std::vector<int> skinmesh; // mesh of every skin reference, -1 if none
 		for (int j = 0; j < qc.submodels[i]->nummesh; j++)
 		{
-			for (int k = 0; k < qc.submodels[i]->normals.size(); k++)
-			{
-				if (qc.submodels[i]->normals[k].skinref == qc.submodels[i]->pmeshes[j]->skinref)
-				{
-					normmap[k] = n;
-					normimap[n] = k;
-					n++;
-					qc.submodels[i]->pmeshes[j]->numnorms++;
-				}
-			}
+			const int skinref = qc.submodels[i]->pmeshes[j]->skinref;
+			if (skinref >= static_cast<int>(skinmesh.size()))
+				skinmesh.resize(skinref + 1, -1);
+			skinmesh[skinref] = j;
+		}
+		const auto mesh_of = [&skinmesh](const Normal &normal)
+		{
+			return normal.skinref >= 0 && normal.skinref < static_cast<int>(skinmesh.size()) ? skinmesh[normal.skinref] : -1;
+		};
+		std::vector<int> meshstart(qc.submodels[i]->nummesh + 1, 0);
+		for (const auto &normal : normals)
+		{
+			const int mesh = mesh_of(normal);
+			if (mesh >= 0)
+				meshstart[mesh + 1]++;
+		}
+		for (int j = 0; j < qc.submodels[i]->nummesh; j++)
+		{
+			qc.submodels[i]->pmeshes[j]->numnorms += meshstart[j + 1];
+			meshstart[j + 1] += meshstart[j];
+		}
+		for (int k = 0; k < normals.size(); k++)
+		{
+			const int mesh = mesh_of(normals[k]);
+			if (mesh < 0)
+				continue;
+			const int n = meshstart[mesh]++;
+			normmap[k] = n;
+			normimap[n] = k;
 		}
 
 		// save vertice bones
+		const std::size_t vertsize = ALIGN(qc.submodels[i]->verts.size()) + ALIGN(qc.submodels[i]->normals.size()) +
+									 ALIGN(qc.submodels[i]->verts.size() * sizeof(Vector3)) + ALIGN(qc.submodels[i]->normals.size() * sizeof(Vector3)) +
+									 section_padding() * 2 + ALIGN(qc.submodels[i]->nummesh * sizeof(StudioMesh));
+		check_buffer_space(g_currentposition, g_bufferend, vertsize);
 		std::uint8_t *pbone = g_currentposition;
 		pmodel[i].numverts = qc.submodels[i]->verts.size();
 		pmodel[i].vertinfoindex = static_cast<int>(g_currentposition - g_bufferstart);
@@ -372,11 +628,13 @@ static void write_model(StudioHeader *header, QC &qc)
 
 		// save group info
 		{
+			g_currentposition = align_section(g_currentposition, g_bufferstart);
 			Vector3 *pvert = (Vector3 *)g_currentposition;
 			g_currentposition += qc.submodels[i]->verts.size() * sizeof(Vector3);
 			pmodel[i].vertindex = static_cast<int>((std::uint8_t *)pvert - g_bufferstart);
 			g_currentposition = (std::uint8_t *)ALIGN(g_currentposition);
 
+			g_currentposition = align_section(g_currentposition, g_bufferstart);
 			Vector3 *pnorm = (Vector3 *)g_currentposition;
 			g_currentposition += qc.submodels[i]->normals.size() * sizeof(Vector3);
 			pmodel[i].normindex = static_cast<int>((std::uint8_t *)pnorm - g_bufferstart);
@@ -421,6 +679,7 @@ static void write_model(StudioHeader *header, QC &qc)
 
 				int numCmdBytes = build_tris(qc.submodels[i]->pmeshes[j]->triangles, qc.submodels[i]->pmeshes[j], &pCmdSrc);
 
+				check_buffer_space(g_currentposition, g_bufferend, ALIGN(numCmdBytes));
 				pmesh[j].triindex = static_cast<int>(g_currentposition - g_bufferstart);
 				memcpy(g_currentposition, pCmdSrc, numCmdBytes);
 				g_currentposition += numCmdBytes;
@@ -434,24 +693,52 @@ static void write_model(StudioHeader *header, QC &qc)
 	}
 }
 
-void write_file(std::filesystem::path path, QC &qc)
+// Writes the animations of a sequence group to its own file, their animindex is relative to that file
+static std::vector<std::byte> write_sequence_group(QC &qc, int group)
+{
+	std::size_t size = sizeof(StudioSequenceGroupHeader);
+	int numsequences = 0;
+	for (auto &sequence : qc.sequences)
+	{
+		if (sequence.seqgroup == group)
+		{
+			size += sequence_animation_size(sequence);
+			numsequences++;
+		}
+	}
+
+	std::vector<std::byte> data(ALIGN(size));
+	std::uint8_t *pStart = (std::uint8_t *)data.data();
+	StudioSequenceGroupHeader *seqheader = (StudioSequenceGroupHeader *)pStart;
+	seqheader->id = IDSTUDIOSEQHEADER;
+	seqheader->version = STUDIO_VERSION;
+	std::strcpy(seqheader->name, sequence_group_file(qc, group).c_str());
+
+	std::uint8_t *pData = (std::uint8_t *)ALIGN(pStart + sizeof(StudioSequenceGroupHeader));
+	pData = write_animations(qc, pData, pStart, pStart + data.size(), group);
+	seqheader->length = static_cast<int>(pData - pStart);
+	data.resize(seqheader->length);
+
+	printf("seqgroup  %6d bytes (%d sequences) %s\n", seqheader->length, numsequences, seqheader->name);
+	return data;
+}
+
+std::vector<std::byte> write_mdl(QC &qc, std::vector<std::vector<std::byte>> &sequence_groups, std::vector<std::byte> &texture_model)
 {
 	int total = 0;
+	g_alignpadding = 0;
 
-	g_bufferstart = (std::uint8_t *)std::calloc(1, FILEBUFFER);
+	split_sequence_groups(qc);
+	std::vector<std::byte> data(model_size(qc));
+	g_bufferstart = (std::uint8_t *)data.data();
+	g_bufferend = g_bufferstart + data.size();
 
 	std::string file_name = strip_extension(qc.modelname) + ".mdl";
 	//
 	// write the model output file
 	//
-	std::filesystem::path mdl_file = path / file_name;
 	printf("---------------------\n");
-	printf("Writing %s:\n", mdl_file.string().c_str());
-	std::unique_ptr<std::ofstream> modelouthandle = safe_open_write(mdl_file);
-	if (!modelouthandle)
-	{
-		error("Failed to open file: " + file_name);
-	}
+	printf("Writing %s:\n", file_name.c_str());
 
 	StudioHeader *studioheader = (StudioHeader *)g_bufferstart;
 
@@ -473,7 +760,12 @@ void write_file(std::filesystem::path path, QC &qc)
 	printf("bones     %6d bytes (%d)\n", g_currentposition - g_bufferstart - total, g_bonetable.size());
 	total = static_cast<int>(g_currentposition - g_bufferstart);
 
-	g_currentposition = write_animations(qc, g_currentposition, g_bufferstart, 0);
+	g_currentposition = write_animations(qc, g_currentposition, g_bufferstart, g_bufferend, 0);
+	sequence_groups.clear();
+	for (int group = 1; group < qc.sequencegroups.size(); group++)
+	{
+		sequence_groups.push_back(write_sequence_group(qc, group));
+	}
 
 	int total_frames = 0;
 	float total_seconds = 0;
@@ -485,12 +777,65 @@ void write_file(std::filesystem::path path, QC &qc)
 	printf("models    %6d bytes\n", g_currentposition - g_bufferstart - total);
 	total = static_cast<int>(g_currentposition - g_bufferstart);
 
-	write_textures(studioheader);
-	printf("textures  %6d bytes\n", g_currentposition - g_bufferstart - total);
+	// the engine loads <model>T.mdl when numtextures is 0
+	texture_model.clear();
+	if (qc.externaltextures)
+	{
+		const std::string texture_file_name = strip_extension(qc.modelname) + "T.mdl";
+		texture_model = write_texture_model(texture_file_name);
+		printf("textures  %6zu bytes (%s)\n", texture_model.size(), texture_file_name.c_str());
+	}
+	else
+	{
+		write_textures(studioheader);
+		printf("textures  %6d bytes\n", g_currentposition - g_bufferstart - total);
+	}
 
 	studioheader->length = static_cast<int>(g_currentposition - g_bufferstart);
 
+	if (g_sectionalign > 4)
+	{
+		printf("alignment %6zu bytes of padding (%d byte sections)\n", g_alignpadding, g_sectionalign);
+	}
+	printf("total     %6d\n", studioheader->length);
+
+	data.resize(studioheader->length);
+	return data;
+}
+
+std::vector<std::byte> write_mdl_textures(const std::vector<std::byte> &mdl, std::vector<std::byte> &texture_model)
+{
+	StudioHeader previousheader;
+	std::memcpy(&previousheader, mdl.data(), sizeof(previousheader));
+	previousheader.name[sizeof(previousheader.name) - 1] = '\0';
+
+	printf("---------------------\n");
+	printf("Writing %s (textures only):\n", previousheader.name);
+
+	// external textures leave the model itself unchanged
+	texture_model.clear();
+	if (previousheader.textureindex == 0)
+	{
+		const std::string texture_file_name = strip_extension(previousheader.name) + "T.mdl";
+		texture_model = write_texture_model(texture_file_name);
+		printf("textures  %6zu bytes (%s)\n", texture_model.size(), texture_file_name.c_str());
+		printf("total     %6zu\n", mdl.size());
+		return mdl;
+	}
+
+	std::vector<std::byte> data(previousheader.textureindex + textures_size());
+	g_bufferstart = (std::uint8_t *)data.data();
+	g_bufferend = g_bufferstart + data.size();
+	std::memcpy(g_bufferstart, mdl.data(), previousheader.textureindex);
+	StudioHeader *studioheader = (StudioHeader *)g_bufferstart;
+	g_currentposition = g_bufferstart + previousheader.textureindex;
+
+	write_textures(studioheader);
+	printf("textures  %6d bytes\n", static_cast<int>(g_currentposition - g_bufferstart) - previousheader.textureindex);
+
+	studioheader->length = static_cast<int>(g_currentposition - g_bufferstart);
 	printf("total     %6d\n", studioheader->length);
 
-	safe_write(*modelouthandle, g_bufferstart, studioheader->length);
+	data.resize(studioheader->length);
+	return data;
 }
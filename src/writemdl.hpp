@@ -1,7 +1,14 @@
 #pragma once
 
-#include <filesystem>
+#include <cstddef>
+#include <vector>
 
 #include "format/qc.hpp"
 
-void write_file(std::filesystem::path path, QC &qc);
\ No newline at end of file
+// Returns the model, sequence_groups receives the <model>NN.mdl file of every sequence group after the first
+// and texture_model receives <model>T.mdl if the textures are external
+std::vector<std::byte> write_mdl(QC &qc, std::vector<std::vector<std::byte>> &sequence_groups, std::vector<std::byte> &texture_model);
+
+// Rewrites the textures of a model written by write_mdl, reusing everything before them byte for byte.
+// g_textures and the skin tables have to match the model's meshes
+std::vector<std::byte> write_mdl_textures(const std::vector<std::byte> &mdl, std::vector<std::byte> &texture_model);
\ No newline at end of file